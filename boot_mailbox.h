@@ -0,0 +1,66 @@
+/* VUSBtinyBoot by me@frank-zhao.com
+ *
+ * Mailbox between the application and the bootloader, include this file in
+ * the application to reset into the bootloader without pressing the reset
+ * button, or to skip the bootloader on the next reset.
+ *
+ * The bootloader reads the mailbox before main() is called, so it has to sit
+ * at the top of RAM, where the application's main() keeps its return address.
+ * That is fine as long as main() never returns.
+ *
+ * Usage in the application:
+ *   bootloader_reset(BOOT_MAILBOX_ENTER);     // update firmware over USB now
+ *   bootloader_reset(BOOT_MAILBOX_APP);       // restart without the bootloader
+ *   bootloader_reset_eeprom(BOOT_FLAG_ENTER); // also survives a power cycle, needs ENABLE_MAILBOX_EEPROM
+ *
+ * The bootloader clears MCUSR before the app runs (WDRF always, every flag with a
+ * BOOT_POLICY other than BOOT_POLICY_ALWAYS) and hands over what it held in r2,
+ * like upstream optiboot. r2 only survives until the app's C runtime starts, so
+ * an app that needs the reset cause keeps it with, at file scope:
+ *   BOOT_RESET_CAUSE_KEEP(resetCause);        // then test resetCause & _BV(WDRF) etc.
+ */
+
+#ifndef BOOT_MAILBOX_H_
+#define BOOT_MAILBOX_H_
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#define BOOT_MAILBOX		(*(volatile uint16_t *)(RAMEND - 1))
+#define BOOT_MAILBOX_ENTER	0x424C	// 'BL', stay in the bootloader
+#define BOOT_MAILBOX_APP	0x4150	// 'AP', start the app at once
+
+// one-shot flag in the last two EEPROM bytes, cleared by the bootloader: the flag in
+// the low byte and its complement in the high byte, so erased or cleared EEPROM is no flag
+#define BOOT_MAILBOX_EEPROM	((uint16_t *)(E2END - 1))
+#define BOOT_FLAG_ENTER		'B'
+#define BOOT_FLAG_APP		'A'
+#define BOOT_FLAG_WORD(f)	((uint16_t)(uint8_t)~(f) << 8 | (uint8_t)(f))
+
+// the reset cause from r2, saved in .init0 before anything else runs
+#define BOOT_RESET_CAUSE_KEEP(var) \
+	uint8_t var __attribute__ ((section (".noinit"))); \
+	void var##_keep(void) __attribute__ ((naked, used, section (".init0"))); \
+	void var##_keep(void) { __asm__ __volatile__ ("sts %0, r2" : "=m" (var)); }
+
+// resets through the watchdog with mode in the mailbox, never returns
+static inline void bootloader_reset(uint16_t mode) __attribute__ ((noreturn));
+static inline void bootloader_reset(uint16_t mode)
+{
+	cli();
+	BOOT_MAILBOX = mode;
+	wdt_enable(WDTO_15MS);
+	for (;;);
+}
+
+// same, with the flag stored in EEPROM as well
+static inline void bootloader_reset_eeprom(uint8_t flag) __attribute__ ((noreturn));
+static inline void bootloader_reset_eeprom(uint8_t flag)
+{
+	eeprom_update_word(BOOT_MAILBOX_EEPROM, BOOT_FLAG_WORD(flag));
+	bootloader_reset(flag == BOOT_FLAG_ENTER ? BOOT_MAILBOX_ENTER : BOOT_MAILBOX_APP);
+}
+
+#endif
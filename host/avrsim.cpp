@@ -0,0 +1,588 @@
+/* Simulated ATmega328P, see avrsim.h */
+
+#include "avrsim.h"
+#include "fw/sim_avr.h"
+
+#include <algorithm>
+#include <cstring>
+
+// the firmware's globals, collected by the Makefile
+extern "C" char __start_fwstate[], __stop_fwstate[];
+
+extern "C" short fw_main(void);
+
+// V-USB's, shared with its interrupt handler, see ../usbdrv/usbdrv.c
+extern "C" {
+	extern uint8_t			usbRxBuf[];
+	extern uint8_t			usbInputBufOffset;
+	extern uint8_t			usbCurrentTok;
+	extern uint8_t			usbRxToken;
+	extern volatile int8_t	usbRxLen;
+	extern volatile uint8_t	usbTxLen;
+	extern uint8_t			usbTxBuf[];
+}
+
+namespace {
+
+const unsigned USB_BUFSIZE = 11;		// PID, 8 bytes data, 2 bytes CRC
+const uint8_t USBPID_DATA0 = 0xC3;
+const uint8_t USBPID_STALL = 0x1E;
+
+// register bits, see fw/avr/io.h
+const uint8_t SREG_I = 0x80;
+const uint8_t INT0_BIT = 1 << 0;
+const uint8_t TOIE1_BIT = 1 << 0;
+const uint8_t TOV1_BIT = 1 << 0;
+const uint8_t RXC0_BIT = 1 << 7;
+const uint8_t TXC0_BIT = 1 << 6;
+const uint8_t UDRE0_BIT = 1 << 5;
+const uint8_t U2X0_BIT = 1 << 1;
+const uint8_t RXCIE0_BIT = 1 << 7;
+const uint8_t RXEN0_BIT = 1 << 4;
+const uint8_t TXEN0_BIT = 1 << 3;
+const uint8_t DMINUS_BIT = 1 << 7;		// USB_CFG_DMINUS_BIT on port D
+const uint8_t DPLUS_BIT = 1 << 2;
+
+// what a hook costs, in CPU cycles, about the loop it is usually polled from
+const unsigned POLL_CYCLES = 8;
+const unsigned USB_POLL_CYCLES = 40;	// usbPoll() reads the lines once
+
+const unsigned STACK_SIZE = 128 * 1024;
+
+// the globals as they are before the firmware first runs
+std::vector<char> &pristine()
+{
+	static std::vector<char> s(__start_fwstate, __stop_fwstate);
+	return s;
+}
+
+SimChip *active = nullptr;				// whose globals are in fwstate
+
+}
+
+SimChip *SimChip::running = nullptr;
+
+SimChip::SimChip(unsigned id, double start, const SimChipTiming &timing, uint8_t resetCause)
+	: flash(FLASH_SIZE, 0xFF), eeprom(EEPROM_SIZE, 0xFF), start(start), timing(timing),
+	  state(pristine()), stack(STACK_SIZE)
+{
+	static const uint8_t row[32] = {
+		0x1E, 0x9C, 0x95, 0xFF, 0x0F, 0x50, 0xFF, 0xFF, 0x55, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+		'S', 'I', 'M', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	// serial number from 0x0E
+	};
+	memcpy(signature, row, sizeof(row));
+	signature[0x14] = id >> 24;
+	signature[0x15] = id >> 16;
+	signature[0x16] = id >> 8;
+	signature[0x17] = id;
+	std::fill(pageBuffer, pageBuffer + PAGE_SIZE / 2, 0xFFFF);
+
+	struct sim_io &io = fw(sim_io);
+	io.MCUSR = resetCause;
+	io.PIND = 0;
+	io.UCSR0A = SIM_READ | UDRE0_BIT;
+	io.UDR0 = SIM_READ;
+
+	getcontext(&chipContext);
+	chipContext.uc_stack.ss_sp = stack.data();
+	chipContext.uc_stack.ss_size = stack.size();
+	chipContext.uc_link = nullptr;
+	makecontext(&chipContext, (void (*)())entry, 0);
+}
+
+SimChip::~SimChip()
+{
+	if (active == this) {
+		active = nullptr;
+	}
+}
+
+void SimChip::entry()
+{
+	fw_main();
+	// main() only returns on an AVR if leave_bootloader() does, it ends in app_start()
+	running->hookAppStart(0);
+}
+
+// ----------------------------------------------------------------------
+// swaps this chip's globals in, or refers to the saved copy while it is not running
+// ----------------------------------------------------------------------
+void SimChip::activate()
+{
+	if (active == this) {
+		return;
+	}
+	size_t size = __stop_fwstate - __start_fwstate;
+	if (active != nullptr) {
+		memcpy(active->state.data(), __start_fwstate, size);
+	}
+	memcpy(__start_fwstate, state.data(), size);
+	active = this;
+}
+
+template<class T> T &SimChip::fw(T &var)
+{
+	if (active == this) {
+		return var;
+	}
+	return *(T *)(state.data() + ((char *)&var - __start_fwstate));
+}
+
+uint64_t SimChip::cycles(double t) const
+{
+	return t <= start ? 0 : (uint64_t)((t - start) * F_CPU + 0.5);
+}
+
+void SimChip::runUntil(double t)
+{
+	uint64_t until = cycles(t);
+
+	if (started || until <= clock) {
+		return;
+	}
+	horizon = until;
+	activate();
+	running = this;
+	swapcontext(&hostContext, &chipContext);
+	running = nullptr;
+}
+
+void SimChip::yield()
+{
+	swapcontext(&chipContext, &hostContext);
+}
+
+// ----------------------------------------------------------------------
+// lets time pass up to t, with the interrupts that fall into it, and gives
+// control back to the host whenever the runUntil() target is reached
+// ----------------------------------------------------------------------
+void SimChip::advanceTo(uint64_t t)
+{
+	while (clock < t) {
+		clock = std::min(t, horizon);
+		sync();
+		if (clock >= horizon) {
+			yield();
+		}
+	}
+	sync();
+}
+
+void SimChip::spend(uint64_t n)
+{
+	advanceTo(clock + n);
+}
+
+// ----------------------------------------------------------------------
+// brings the peripherals up to the current time, run on every hook
+// ----------------------------------------------------------------------
+void SimChip::sync()
+{
+	syncTimer();
+	syncUart();
+}
+
+uint64_t SimChip::nextTimerOverflow() const
+{
+	static const unsigned prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	unsigned p = prescale[sim_io.TCCR1B & 7];
+
+	if (p == 0) {
+		return UINT64_MAX;
+	}
+	return clock + (uint64_t)(0x10000 - sim_io.TCNT1) * p - timerResidue;
+}
+
+void SimChip::syncTimer()
+{
+	static const unsigned prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	unsigned p = prescale[sim_io.TCCR1B & 7];
+	uint64_t elapsed = clock - timerSynced;
+
+	timerSynced = clock;
+	if ((sim_io.TIFR1 & TOV1_BIT) != 0) {
+		// writing a one clears the flag
+		timerOverflowed = false;
+	}
+	sim_io.TIFR1 = 0;
+	if (p == 0) {
+		timerResidue = 0;
+		return;
+	}
+
+	uint64_t ticks = (timerResidue + elapsed) / p;
+	timerResidue = (timerResidue + elapsed) % p;
+	uint64_t overflows = (sim_io.TCNT1 + ticks) >> 16;
+	sim_io.TCNT1 += ticks;
+	if (overflows != 0) {
+		timerOverflowed = true;
+	}
+	if (!timerOverflowed || (sim_io.TIMSK1 & TOIE1_BIT) == 0 || (sim_io.SREG & SREG_I) == 0) {
+		return;
+	}
+	// one call for each overflow while the interrupt is on, one for the flag otherwise,
+	// TIMER1_COMPA only ends the LED pulse while fading and is left out
+	timerOverflowed = false;
+	for (uint64_t i = std::max<uint64_t>(overflows, 1); i > 0; i--) {
+		sim_io.SREG &= ~SREG_I;
+		sim_timer1_ovf();
+		sim_io.SREG |= SREG_I;
+	}
+}
+
+uint64_t SimChip::byteCycles() const
+{
+	unsigned ubrr = sim_io.UBRR0L | (sim_io.UBRR0H & 0x0F) << 8;
+
+	// start bit, 8 data bits and a stop bit
+	return (uint64_t)10 * (u2x ? 8 : 16) * (ubrr + 1);
+}
+
+// ----------------------------------------------------------------------
+// what the firmware stored into UCSR0A and UDR0 since the last hook, then
+// the receiver and transmitter up to now
+// ----------------------------------------------------------------------
+void SimChip::syncUart()
+{
+	if ((sim_io.UCSR0A & SIM_READ) == 0) {
+		u2x = (sim_io.UCSR0A & U2X0_BIT) != 0;
+		if ((sim_io.UCSR0A & TXC0_BIT) != 0) {
+			txComplete = false;
+		}
+		sim_io.UCSR0A = SIM_READ;
+	}
+	if ((sim_io.UDR0 & SIM_READ) == 0) {
+		uint8_t b = sim_io.UDR0;
+		if ((sim_io.UCSR0B & TXEN0_BIT) != 0 && !txBusy) {
+			txBusy = true;
+			txShift = b;
+			txDone = clock + byteCycles();
+		}
+		else if ((sim_io.UCSR0B & TXEN0_BIT) != 0) {
+			udrFull = true;
+			udr = b;
+		}
+		sim_io.UDR0 = SIM_READ;
+	}
+	else if (udrHandedOut) {
+		rxFifo.pop_front();
+	}
+	udrHandedOut = false;
+
+	while (txBusy && txDone <= clock) {
+		if (onUartTransmit) {
+			onUartTransmit(txShift, start + (double)txDone / F_CPU);
+		}
+		if (udrFull) {
+			udrFull = false;
+			txShift = udr;
+			txDone += byteCycles();
+		}
+		else {
+			txBusy = false;
+			txComplete = true;
+		}
+	}
+
+	while (!rxLine.empty() && rxLine.front().at <= clock) {
+		if ((sim_io.UCSR0B & RXEN0_BIT) == 0) {
+			// the receiver is off, the byte is lost
+		}
+		else if (rxFifo.size() < 3) {
+			rxFifo.push_back(rxLine.front().b);
+		}
+		else {
+			uartOverruns++;
+		}
+		rxLine.pop_front();
+	}
+	if (!rxFifo.empty() && (sim_io.UCSR0B & RXCIE0_BIT) != 0 && (sim_io.SREG & SREG_I) != 0) {
+		// what optiboot's naked UART_RX_vect does, it only wakes the main loop
+		sim_io.UCSR0B &= ~RXCIE0_BIT;
+	}
+}
+
+volatile uint16_t *SimChip::hookTcnt1()
+{
+	spend(POLL_CYCLES);
+	return &sim_io.TCNT1;
+}
+
+volatile uint8_t *SimChip::hookPind()
+{
+	spend(USB_POLL_CYCLES);
+
+	// D- is held up by the 1.5k pullup (J) unless the firmware pulls it low to
+	// disconnect, D+ is low except in packets
+	uint8_t lines = DMINUS_BIT;
+	if ((sim_io.DDRD & DMINUS_BIT) != 0 && (sim_io.PORTD & DMINUS_BIT) == 0) {
+		lines = 0;
+	}
+	else if (clock >= resetFrom && clock < resetTo) {
+		lines = 0;
+	}
+	sim_io.PIND = (sim_io.PIND & ~(DMINUS_BIT | DPLUS_BIT)) | lines;
+	return &sim_io.PIND;
+}
+
+volatile uint16_t *SimChip::hookUcsr0a()
+{
+	spend(POLL_CYCLES);
+	sim_io.UCSR0A = SIM_READ | (u2x ? U2X0_BIT : 0)
+		| (rxFifo.empty() ? 0 : RXC0_BIT)
+		| (txComplete ? TXC0_BIT : 0)
+		| (udrFull ? 0 : UDRE0_BIT);
+	return &sim_io.UCSR0A;
+}
+
+volatile uint16_t *SimChip::hookUdr0()
+{
+	spend(POLL_CYCLES);
+	udrHandedOut = !rxFifo.empty();
+	sim_io.UDR0 = SIM_READ | (rxFifo.empty() ? 0 : rxFifo.front());
+	return &sim_io.UDR0;
+}
+
+void SimChip::hookDelay(double us)
+{
+	spend((uint64_t)(us * F_CPU / 1000000));
+}
+
+// ----------------------------------------------------------------------
+// sleep_cpu(), until the next interrupt: a Timer1 overflow, a byte for
+// optiboot's RX interrupt, or whatever the host does by the runUntil() target
+// ----------------------------------------------------------------------
+void SimChip::hookSleep()
+{
+	uint64_t wake = horizon;
+
+	if ((sim_io.TIMSK1 & TOIE1_BIT) != 0) {
+		wake = std::min(wake, nextTimerOverflow());
+	}
+	if ((sim_io.UCSR0B & RXCIE0_BIT) != 0 && !rxLine.empty()) {
+		wake = std::min(wake, rxLine.front().at);
+	}
+	spend(wake > clock ? wake - clock : 1);
+}
+
+uint8_t SimChip::hookFlashRead(uint32_t addr)
+{
+	spend(3);
+	addr %= FLASH_SIZE;
+	if (rwwBusy && addr < BOOT_START) {
+		rwwReadsWhileBusy++;
+		return 0xFF;
+	}
+	return flash[addr];
+}
+
+bool SimChip::spmStart(uint32_t addr)
+{
+	spend(POLL_CYCLES);
+	if (spmBusy()) {
+		spmWhileBusy++;
+		return false;
+	}
+	if (addr % FLASH_SIZE >= BOOT_START) {
+		spmIntoBootSection++;
+		return false;
+	}
+	return true;
+}
+
+void SimChip::hookSpmFill(uint32_t addr, uint16_t data)
+{
+	if (spmStart(addr)) {
+		pageBuffer[addr % PAGE_SIZE / 2] = data;
+	}
+}
+
+void SimChip::hookSpmErase(uint32_t addr)
+{
+	if (spmStart(addr)) {
+		uint32_t page = addr % FLASH_SIZE / PAGE_SIZE * PAGE_SIZE;
+		std::fill(flash.begin() + page, flash.begin() + page + PAGE_SIZE, 0xFF);
+		spmBusyUntil = clock + (uint64_t)(timing.eraseMs * F_CPU / 1000);
+		rwwBusy = true;
+		pagesErased++;
+	}
+}
+
+void SimChip::hookSpmWrite(uint32_t addr)
+{
+	if (spmStart(addr)) {
+		uint32_t page = addr % FLASH_SIZE / PAGE_SIZE * PAGE_SIZE;
+		// programming can only clear bits, a page that was not erased keeps its zeros
+		for (unsigned i = 0; i < PAGE_SIZE; i++) {
+			flash[page + i] &= pageBuffer[i / 2] >> (i % 2 * 8);
+		}
+		std::fill(pageBuffer, pageBuffer + PAGE_SIZE / 2, 0xFFFF);
+		spmBusyUntil = clock + (uint64_t)(timing.writeMs * F_CPU / 1000);
+		rwwBusy = true;
+		pagesWritten++;
+	}
+}
+
+void SimChip::hookSpmRwwEnable()
+{
+	spend(POLL_CYCLES);
+	if (spmBusy()) {
+		spmWhileBusy++;
+		return;
+	}
+	// it also clears the page buffer
+	std::fill(pageBuffer, pageBuffer + PAGE_SIZE / 2, 0xFFFF);
+	rwwBusy = false;
+}
+
+uint8_t SimChip::hookSpmBusy()
+{
+	spend(POLL_CYCLES);
+	return spmBusy();
+}
+
+void SimChip::hookSpmBusyWait()
+{
+	advanceTo(std::max(clock + POLL_CYCLES, spmBusyUntil));
+}
+
+uint8_t SimChip::hookLockFuseBits(uint8_t addr)
+{
+	// low, lock, extended, high: 16 MHz crystal, boot section locked, BOD 2.7 V, 2 KW boot section
+	static const uint8_t bits[4] = { 0xFF, 0xEF, 0xFD, 0xD8 };
+
+	spend(POLL_CYCLES);
+	return bits[addr & 3];
+}
+
+uint8_t SimChip::hookSignatureByte(uint8_t addr)
+{
+	spend(POLL_CYCLES);
+	return signature[addr & 0x1F];
+}
+
+uint8_t SimChip::hookEepromRead(uint16_t addr)
+{
+	advanceTo(std::max(clock + POLL_CYCLES, eepromBusyUntil));
+	return eeprom[addr % EEPROM_SIZE];
+}
+
+void SimChip::hookEepromWrite(uint16_t addr, uint8_t data)
+{
+	advanceTo(std::max(clock + POLL_CYCLES, eepromBusyUntil));
+	eeprom[addr % EEPROM_SIZE] = data;
+	eepromBusyUntil = clock + (uint64_t)(timing.eepromMs * F_CPU / 1000);
+}
+
+// ----------------------------------------------------------------------
+// the end of the firmware's run, the coroutine is never resumed
+// ----------------------------------------------------------------------
+void SimChip::hookAppStart(uint8_t r2)
+{
+	sync();
+	started = true;
+	startedAt = clock;
+	startedR2 = r2;
+	startedEarly = spmBusy() || rwwBusy;
+	while (true) {
+		yield();
+	}
+}
+
+bool SimChip::usbAttached()
+{
+	struct sim_io &io = fw(sim_io);
+
+	return !started && ((io.DDRD & DMINUS_BIT) == 0 || (io.PORTD & DMINUS_BIT) != 0);
+}
+
+void SimChip::usbReset(double from, double to)
+{
+	resetFrom = cycles(from);
+	resetTo = cycles(to);
+}
+
+// ----------------------------------------------------------------------
+// V-USB's interrupt for a SETUP or OUT token and the DATA packet after it:
+// NAKed while usbPoll() has not taken the last one, a zero-length packet
+// (a status stage) is only acknowledged
+// ----------------------------------------------------------------------
+SimChip::Handshake SimChip::usbReceive(uint8_t token, const uint8_t *data, unsigned len)
+{
+	struct sim_io &io = fw(sim_io);
+
+	if (started || (io.SREG & SREG_I) == 0 || (io.EIMSK & INT0_BIT) == 0) {
+		return NONE;
+	}
+	fw(usbCurrentTok) = token;
+	if (fw(usbRxLen) != 0) {
+		return NAK;
+	}
+	if (len == 0) {
+		return ACK;
+	}
+	uint8_t &offset = fw(usbInputBufOffset);
+	uint8_t *buf = &fw(usbRxBuf[0]) + offset;
+	buf[0] = USBPID_DATA0;
+	memcpy(buf + 1, data, len);
+	fw(usbRxLen) = len + 3;
+	fw(usbRxToken) = token;
+	offset = USB_BUFSIZE - offset;
+	return ACK;
+}
+
+// ----------------------------------------------------------------------
+// V-USB's interrupt for an IN token: NAKed until usbPoll() has handled what
+// was received and queued the answer in usbTxBuf
+// ----------------------------------------------------------------------
+SimChip::Handshake SimChip::usbIn(std::vector<uint8_t> &data)
+{
+	struct sim_io &io = fw(sim_io);
+
+	if (started || (io.SREG & SREG_I) == 0 || (io.EIMSK & INT0_BIT) == 0) {
+		return NONE;
+	}
+	if (fw(usbRxLen) > 0) {
+		return NAK;
+	}
+	uint8_t len = fw(usbTxLen);
+	if ((len & 0x10) != 0) {
+		// a handshake
+		return len == USBPID_STALL ? STALL : NAK;
+	}
+	const uint8_t *buf = &fw(usbTxBuf[0]);
+	data.assign(buf + 1, buf + len - 3);	// sync, PID, data, CRC16
+	fw(usbTxLen) = 0x5A;					// USBPID_NAK
+	return ACK;
+}
+
+void SimChip::uartReceive(uint8_t b, double t)
+{
+	rxLine.push_back({ std::max(cycles(t), rxLine.empty() ? 0 : rxLine.back().at), b });
+}
+
+// ----------------------------------------------------------------------
+// the hooks of fw/sim_avr.h, the firmware only runs within runUntil()
+// ----------------------------------------------------------------------
+extern "C" {
+
+volatile uint16_t *sim_tcnt1(void) { return SimChip::running->hookTcnt1(); }
+volatile uint8_t *sim_pind(void) { return SimChip::running->hookPind(); }
+volatile uint16_t *sim_ucsr0a(void) { return SimChip::running->hookUcsr0a(); }
+volatile uint16_t *sim_udr0(void) { return SimChip::running->hookUdr0(); }
+void sim_delay_us(double us) { SimChip::running->hookDelay(us); }
+void sim_sleep(void) { SimChip::running->hookSleep(); }
+uint8_t sim_flash_read(uint32_t addr) { return SimChip::running->hookFlashRead(addr); }
+void sim_spm_fill(uint32_t addr, uint16_t data) { SimChip::running->hookSpmFill(addr, data); }
+void sim_spm_erase(uint32_t addr) { SimChip::running->hookSpmErase(addr); }
+void sim_spm_write(uint32_t addr) { SimChip::running->hookSpmWrite(addr); }
+void sim_spm_rww_enable(void) { SimChip::running->hookSpmRwwEnable(); }
+uint8_t sim_spm_busy(void) { return SimChip::running->hookSpmBusy(); }
+void sim_spm_busy_wait(void) { SimChip::running->hookSpmBusyWait(); }
+uint8_t sim_lock_fuse_bits(uint8_t addr) { return SimChip::running->hookLockFuseBits(addr); }
+uint8_t sim_signature_byte(uint8_t addr) { return SimChip::running->hookSignatureByte(addr); }
+uint8_t sim_eeprom_read(uint16_t addr) { return SimChip::running->hookEepromRead(addr); }
+void sim_eeprom_write(uint16_t addr, uint8_t data) { SimChip::running->hookEepromWrite(addr, data); }
+void sim_app_start(uint8_t r2) { SimChip::running->hookAppStart(r2); }
+
+}
@@ -0,0 +1,163 @@
+/* One simulated ATmega328P running the bootloader firmware
+ *
+ * ../main.c and ../optiboot.c, with the real V-USB driver, are built for the
+ * host against the stub headers in fw/ (see fw/sim_avr.h) and linked in.
+ * Every SimChip runs that firmware from reset on a coroutine of its own, with
+ * its own copy of the firmware's globals: the Makefile moves them into the
+ * fwstate section, which is swapped in whenever another chip runs.
+ *
+ * Time only passes in the hooks the stubs call, register reads, delays, SPM
+ * and EEPROM each cost about what they do on the chip, and sleep skips ahead
+ * to the next interrupt. Timer1 overflows call the firmware's handler.
+ * Everything else about the chip is modelled only as far as the firmware
+ * can tell:
+ * - flash with the SPM page buffer, page erase and write times, and the RWW
+ *   section reading 0xFF until boot_rww_enable() after an erase or write
+ * - EEPROM writes that take 3.4 ms each
+ * - the UART with its two byte receive FIFO, baud rate and transmitter
+ * - the USB lines as the firmware reads them, bus resets included. The USB
+ *   interrupt, which is assembly in V-USB, is usbReceive() and usbIn() below,
+ *   called by SimBus (sim.h) and working on the driver's buffers the same way.
+ */
+
+#ifndef AVRSIM_H_
+#define AVRSIM_H_
+
+#include <stdint.h>
+#include <ucontext.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+struct SimChipTiming {
+	double		eraseMs = 4.0;			// SPM page erase and page write, 3.7 to 4.5 ms on the ATmega328P
+	double		writeMs = 4.0;
+	double		eepromMs = 3.4;			// one EEPROM byte
+};
+
+class SimChip {
+public:
+	static const unsigned F_CPU = 16000000;
+	static const unsigned FLASH_SIZE = 32768;
+	static const unsigned PAGE_SIZE = 128;
+	static const unsigned BOOT_START = 0x7000;	// BOOTLOADER_ADDRESS in the Makefile
+	static const unsigned EEPROM_SIZE = 1024;
+
+	// powers the chip up at time start with MCUSR set to resetCause, the serial
+	// number the firmware reports is made from id
+	SimChip(unsigned id, double start, const SimChipTiming &timing, uint8_t resetCause);
+	~SimChip();
+	SimChip(const SimChip &) = delete;
+	SimChip &operator=(const SimChip &) = delete;
+
+	// runs the firmware up to time t, or until it jumps to the app
+	void runUntil(double t);
+	double now() const { return start + (double)clock / F_CPU; }
+
+	bool appStarted() const { return started; }
+	double appStartTime() const { return start + (double)startedAt / F_CPU; }
+	uint8_t appR2() const { return startedR2; }
+	// SPM still busy or the RWW section still disabled when the app was started
+	bool appStartedEarly() const { return startedEarly; }
+
+	// USB: the D- pullup is connected, and the lines are held in SE0 from..to by the host
+	bool usbAttached();
+	void usbReset(double from, double to);
+
+	// the USB interrupt for one transaction, NONE when the firmware has it disabled
+	enum Handshake { NONE, ACK, NAK, STALL };
+	Handshake usbReceive(uint8_t token, const uint8_t *data, unsigned len);	// SETUP or OUT, then DATA
+	Handshake usbIn(std::vector<uint8_t> &data);
+
+	// UART: a byte whose stop bit ends at time t on RXD, times must not go back
+	void uartReceive(uint8_t b, double t);
+	// called with every byte whose stop bit has left TXD, and that time
+	std::function<void(uint8_t, double)>	onUartTransmit;
+
+	std::vector<uint8_t>	flash;
+	std::vector<uint8_t>	eeprom;
+	unsigned				pagesErased = 0;
+	unsigned				pagesWritten = 0;
+	unsigned				spmWhileBusy = 0;		// SPM issued before the last one finished
+	unsigned				rwwReadsWhileBusy = 0;	// RWW section read before boot_rww_enable()
+	unsigned				spmIntoBootSection = 0;	// the boot section can not program itself
+	unsigned				uartOverruns = 0;
+
+	// the hooks, only called by the firmware through fw/sim_avr.h
+	static SimChip			*running;
+	volatile uint16_t *hookTcnt1();
+	volatile uint8_t *hookPind();
+	volatile uint16_t *hookUcsr0a();
+	volatile uint16_t *hookUdr0();
+	void hookDelay(double us);
+	void hookSleep();
+	uint8_t hookFlashRead(uint32_t addr);
+	void hookSpmFill(uint32_t addr, uint16_t data);
+	void hookSpmErase(uint32_t addr);
+	void hookSpmWrite(uint32_t addr);
+	void hookSpmRwwEnable();
+	uint8_t hookSpmBusy();
+	void hookSpmBusyWait();
+	uint8_t hookLockFuseBits(uint8_t addr);
+	uint8_t hookSignatureByte(uint8_t addr);
+	uint8_t hookEepromRead(uint16_t addr);
+	void hookEepromWrite(uint16_t addr, uint8_t data);
+	[[noreturn]] void hookAppStart(uint8_t r2);
+
+private:
+	static void entry();
+	void activate();
+	template<class T> T &fw(T &var);
+
+	uint64_t cycles(double t) const;
+	void spend(uint64_t n);
+	void advanceTo(uint64_t t);
+	void sync();
+	void yield();
+	void syncTimer();
+	void syncUart();
+	uint64_t nextTimerOverflow() const;
+	uint64_t byteCycles() const;
+	bool spmBusy() const { return clock < spmBusyUntil; }
+	bool spmStart(uint32_t addr);
+
+	const double			start;
+	const SimChipTiming		timing;
+	uint64_t				clock = 0;			// CPU cycles since power up
+	uint64_t				horizon = 0;		// runUntil() target
+	std::vector<char>		state;				// the firmware's globals while another chip runs
+	std::vector<char>		stack;
+	ucontext_t				chipContext;
+	ucontext_t				hostContext;
+	bool					started = false;
+	uint64_t				startedAt = 0;
+	uint8_t					startedR2 = 0;
+	bool					startedEarly = false;
+
+	uint8_t					signature[32];
+	uint16_t				pageBuffer[PAGE_SIZE / 2];
+	uint64_t				spmBusyUntil = 0;
+	bool					rwwBusy = false;
+	uint64_t				eepromBusyUntil = 0;
+
+	uint64_t				timerSynced = 0;
+	unsigned				timerResidue = 0;	// cycles towards the next prescaled tick
+	bool					timerOverflowed = false;
+
+	uint64_t				resetFrom = 0;
+	uint64_t				resetTo = 0;
+
+	struct RxByte { uint64_t at; uint8_t b; };
+	std::deque<RxByte>		rxLine;				// not yet received
+	std::deque<uint8_t>		rxFifo;				// UDR0 and the byte behind it, plus the shift register
+	bool					udrHandedOut = false;
+	bool					u2x = false;
+	bool					txBusy = false;		// shift register
+	uint64_t				txDone = 0;
+	uint8_t					txShift = 0;
+	bool					udrFull = false;
+	uint8_t					udr = 0;
+	bool					txComplete = false;
+};
+
+#endif
@@ -0,0 +1,345 @@
+/* Pipelined flashing of one bootloader, see flasher.h */
+
+#include "flasher.h"
+#include "usbtiny.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+static std::string hexAddr(uint32_t addr)
+{
+	char s[16];
+
+	snprintf(s, sizeof(s), "0x%04x", addr);
+	return s;
+}
+
+// ----------------------------------------------------------------------
+// CRC16 of a page as USBTINY_PAGE_CRC returns it, like usbCrc16()
+// ----------------------------------------------------------------------
+static uint16_t pageCrc(const std::vector<uint8_t> &data)
+{
+	uint16_t crc = 0xFFFF;
+
+	for (uint8_t b : data) {
+		crc ^= b;
+		for (int i = 0; i < 8; i++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+Flasher::Flasher(Bus &bus, Device &dev, const std::vector<Page> &pages, unsigned pageSize, const FlashOptions &opt)
+	: bus(bus), dev(dev), opt(opt), pageSize(pageSize), chunk(opt.chunk), pageList(pages), erased(pages.size(), false)
+{
+	if (chunk == 0) {
+		chunk = pageSize;
+		while (chunk > usbtiny::MAX_TRANSFER) {
+			chunk /= 2;
+		}
+	}
+	if (chunk > usbtiny::MAX_TRANSFER) {
+		chunk = usbtiny::MAX_TRANSFER;
+	}
+	if (this->opt.depth == 0) {
+		this->opt.depth = 1;
+	}
+	// what progress() counts on until the blank pages are sorted out
+	totalBytes = pages.size() * pageSize * (opt.verify ? 2 : 1);
+
+	for (unsigned i = 0; i < opt.signature.size(); i++) {
+		steps.push_back({ usbtiny::SPI, i, 4, 0, false });
+	}
+	if (opt.oldFlash != nullptr) {
+		addOldFlashChecks();
+		addPatches();
+	}
+	else if (opt.skipBlank) {
+		addBlankChecks();	// pump() adds the writes once they are done
+	}
+	else {
+		addWrites();
+	}
+}
+
+void Flasher::addExtAddr(uint32_t addr)
+{
+	if ((addr >> 16) != extAddr) {
+		extAddr = addr >> 16;
+		steps.push_back({ usbtiny::EXT_ADDR, addr, 0, 0, false });
+	}
+}
+
+// ----------------------------------------------------------------------
+// one USBTINY_PAGE_CRC for each run of consecutive blank pages, the writes
+// are only planned once all of them have answered
+// ----------------------------------------------------------------------
+void Flasher::addBlankChecks()
+{
+	const unsigned maxPages = usbtiny::MAX_TRANSFER / 2;
+
+	for (size_t i = 0; i < pageList.size(); ) {
+		if (!pageList[i].blank) {
+			i++;
+			continue;
+		}
+		uint32_t addr = pageList[i].addr;
+		size_t n = 1;
+		while (i + n < pageList.size() && n < maxPages && pageList[i + n].blank
+			&& pageList[i + n].addr == addr + n * pageSize && ((addr + n * pageSize) & 0xFFFF) != 0) {
+			n++;
+		}
+		addExtAddr(addr);
+		steps.push_back({ usbtiny::PAGE_CRC, addr, (uint16_t)(n * 2), i, false });
+		i += n;
+	}
+}
+
+// ----------------------------------------------------------------------
+// one USBTINY_PAGE_CRC for up to 127 pages of the app section that patches
+// are made against
+// ----------------------------------------------------------------------
+void Flasher::addOldFlashChecks()
+{
+	const unsigned maxPages = usbtiny::MAX_TRANSFER / 2;
+	size_t pages = opt.oldFlash->size() / pageSize;
+
+	for (size_t i = 0; i < pages; ) {
+		uint32_t addr = i * pageSize;
+		size_t n = std::min<size_t>(maxPages, pages - i);
+		n = std::min<size_t>(n, (0x10000 - (addr & 0xFFFF)) / pageSize);
+		addExtAddr(addr);
+		steps.push_back({ usbtiny::PAGE_CRC, addr, (uint16_t)(n * 2), i, false });
+		i += n;
+	}
+}
+
+// ----------------------------------------------------------------------
+// the changed pages, as patches or whole, in the order patch.h planned them
+// ----------------------------------------------------------------------
+void Flasher::addPatches()
+{
+	std::vector<PagePatch> patches = makePatches(*opt.oldFlash, pageList, pageSize);
+	std::map<uint32_t, size_t> offset;	// of each changed page in runs
+
+	writesAdded = true;
+	for (const PagePatch &pp : patches) {
+		offset[pp.addr] = 0;
+	}
+	unchanged = pageList.size() - patches.size();
+	for (const Page &p : pageList) {
+		if (offset.count(p.addr) == 0) {
+			continue;
+		}
+		if (runList.empty() || runList.back().addr + runList.back().len != p.addr || (p.addr & 0xFFFF) == 0) {
+			runList.push_back({ p.addr, runs.size(), 0 });
+		}
+		offset[p.addr] = runs.size();
+		runs.insert(runs.end(), p.data.begin(), p.data.end());
+		runList.back().len += p.data.size();
+	}
+
+	totalBytes = 0;
+	size_t first = steps.size();
+	for (const PagePatch &pp : patches) {
+		addExtAddr(pp.addr);
+		if (pp.ops.empty()) {
+			for (size_t pos = 0; pos < pageSize; pos += chunk) {
+				uint16_t len = std::min<size_t>(chunk, pageSize - pos);
+				steps.push_back({ usbtiny::FLASH_WRITE, (uint32_t)(pp.addr + pos), len, offset[pp.addr] + pos, false });
+				totalBytes += len;
+			}
+			continue;
+		}
+		steps.push_back({ usbtiny::PATCH_PAGE, pp.addr, (uint16_t)pp.ops.size(), runs.size(), false });
+		runs.insert(runs.end(), pp.ops.begin(), pp.ops.end());
+		totalBytes += pp.ops.size();
+		patched++;
+	}
+	if (first < steps.size()) {
+		// nothing is written before the signature and the old flash have been checked
+		steps[first].barrier = true;
+	}
+	if (opt.verify) {
+		addTransfers(usbtiny::FLASH_READ, chunk);
+	}
+	if (opt.exit) {
+		steps.push_back({ usbtiny::POWERDOWN, 0, 0, 0, true });
+	}
+}
+
+// ----------------------------------------------------------------------
+// the writes, the read back and POWERDOWN, for every page not known to be
+// erased already
+// ----------------------------------------------------------------------
+void Flasher::addWrites()
+{
+	writesAdded = true;
+	for (size_t i = 0; i < pageList.size(); i++) {
+		const Page &p = pageList[i];
+		if (erased[i]) {
+			blankSkipped++;
+			continue;
+		}
+		if (runList.empty() || runList.back().addr + runList.back().len != p.addr || (p.addr & 0xFFFF) == 0) {
+			runList.push_back({ p.addr, runs.size(), 0 });
+		}
+		runs.insert(runs.end(), p.data.begin(), p.data.end());
+		runList.back().len += p.data.size();
+	}
+
+	totalBytes = 0;
+	size_t first = steps.size();
+	addTransfers(usbtiny::FLASH_WRITE, chunk);
+	if (first < steps.size()) {
+		// nothing is written before the signature has been checked
+		steps[first].barrier = !opt.signature.empty() || opt.skipBlank;
+	}
+	if (opt.verify) {
+		addTransfers(usbtiny::FLASH_READ, chunk);
+	}
+	if (opt.exit) {
+		steps.push_back({ usbtiny::POWERDOWN, 0, 0, 0, true });
+	}
+}
+
+// ----------------------------------------------------------------------
+// cuts every run into transfers of up to chunk bytes, the first one of each
+// run starts page aligned
+// ----------------------------------------------------------------------
+void Flasher::addTransfers(uint8_t request, unsigned chunk)
+{
+	for (const Run &r : runList) {
+		addExtAddr(r.addr);
+		for (size_t pos = 0; pos < r.len; pos += chunk) {
+			uint16_t len = r.len - pos < chunk ? r.len - pos : chunk;
+			steps.push_back({ request, (uint32_t)(r.addr + pos), len, r.data + pos, false });
+			totalBytes += len;
+		}
+	}
+}
+
+void Flasher::start()
+{
+	startTime = bus.now();
+	pump();
+	if (finished()) {
+		endTime = bus.now();
+	}
+}
+
+void Flasher::fail(const std::string &text)
+{
+	if (!failed) {
+		failed = true;
+		errorText = text;
+	}
+}
+
+// ----------------------------------------------------------------------
+// keeps up to opt.depth transfers queued on the device
+// ----------------------------------------------------------------------
+void Flasher::pump()
+{
+	if (!writesAdded && next == steps.size() && inFlight == 0) {
+		addWrites();
+	}
+	while (!failed && next < steps.size() && inFlight < opt.depth) {
+		const Step &s = steps[next];
+		if (s.barrier && inFlight > 0) {
+			break;
+		}
+
+		std::unique_ptr<Transfer> t(new Transfer);
+		t->request = s.request;
+		t->value = 0;
+		t->index = s.addr & 0xFFFF;
+		if (s.request == usbtiny::FLASH_WRITE || s.request == usbtiny::PATCH_PAGE) {
+			t->requestType = usbtiny::REQUEST_OUT;
+			t->data.assign(&runs[s.data], &runs[s.data] + s.len);
+		}
+		else if (s.request == usbtiny::EXT_ADDR) {
+			t->requestType = usbtiny::REQUEST_OUT;
+			t->index = s.addr >> 16;
+		}
+		else if (s.request == usbtiny::SPI) {
+			// read signature byte, ISP command 0x30 0x00 addr 0x00
+			t->requestType = usbtiny::REQUEST_IN;
+			t->value = 0x0030;
+			t->index = s.addr;
+			t->data.resize(s.len);
+		}
+		else {
+			t->requestType = usbtiny::REQUEST_IN;
+			t->data.resize(s.len);
+		}
+		size_t index = next;
+		t->done = [this, index](Transfer &t) {
+			inFlight--;
+			completed(steps[index], t);
+			pump();
+			if (finished()) {
+				endTime = bus.now();
+			}
+			if (onProgress) {
+				onProgress(*this);
+			}
+		};
+
+		if (!dev.submit(std::move(t))) {
+			fail("cannot queue a transfer");
+			break;
+		}
+		inFlight++;
+		next++;
+	}
+}
+
+void Flasher::completed(const Step &s, Transfer &t)
+{
+	if (s.request == usbtiny::PAGE_CRC && opt.oldFlash != nullptr) {
+		for (size_t i = 0; i < s.len / 2u && !failed; i++) {
+			auto page = opt.oldFlash->begin() + (s.data + i) * pageSize;
+			if (t.status != 0 || 2 * i + 1 >= t.data.size()) {
+				fail("no USBTINY_PAGE_CRC, patching needs ENABLE_PAGE_CRC and ENABLE_PATCHING");
+			}
+			else if ((t.data[2 * i] | t.data[2 * i + 1] << 8) != pageCrc(std::vector<uint8_t>(page, page + pageSize))) {
+				fail("the flash does not hold the old image at " + hexAddr((s.data + i) * pageSize));
+			}
+		}
+		return;
+	}
+	if (s.request == usbtiny::PAGE_CRC) {
+		// a bootloader without ENABLE_PAGE_CRC fails it or sends nothing, the pages are written then
+		for (size_t i = 0; t.status == 0 && i < s.len / 2u && 2 * i + 1 < t.data.size(); i++) {
+			erased[s.data + i] = (t.data[2 * i] | t.data[2 * i + 1] << 8) == pageCrc(pageList[s.data + i].data);
+		}
+		return;
+	}
+	if (t.status != 0) {
+		fail("transfer failed at " + hexAddr(s.addr) + " (request " + std::to_string(s.request) + ")");
+		return;
+	}
+	if (s.request == usbtiny::SPI) {
+		if (t.data.size() < 4 || t.data[3] != opt.signature[s.addr]) {
+			fail("signature does not match");
+		}
+	}
+	else if (s.request == usbtiny::FLASH_READ) {
+		if (t.data.size() != s.len) {
+			fail("short read at " + hexAddr(s.addr));
+		}
+		for (size_t i = 0; i < t.data.size() && !failed; i++) {
+			if (t.data[i] != runs[s.data + i]) {
+				fail("verify error at " + hexAddr(s.addr + i));
+			}
+		}
+		doneBytes += s.len;
+	}
+	else if (s.request == usbtiny::FLASH_WRITE || s.request == usbtiny::PATCH_PAGE) {
+		doneBytes += s.len;
+		writeBytes += s.len;
+	}
+}
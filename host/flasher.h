@@ -0,0 +1,117 @@
+/* Pipelined flashing of one bootloader
+ *
+ * The image is sent as FLASH_WRITE transfers cut from runs of consecutive
+ * pages, so every transfer starts page aligned and each page is committed by
+ * the bootloader's page cache once. Up to FlashOptions::depth transfers are
+ * kept queued on the device: endpoint 0 still runs them one after the other,
+ * but the next one is ready as soon as the bootloader takes packets again,
+ * without a round trip through the host for every transfer.
+ *
+ * The signature is checked before anything is written and POWERDOWN is only
+ * sent once every transfer (and the read back, if asked for) went through.
+ *
+ * Pages of the image that only hold 0xFF are written like any other, the
+ * bootloader does no chip erase and the old app may still be there. With
+ * FlashOptions::skipBlank they are first compared by USBTINY_PAGE_CRC and
+ * only skipped where the flash is already erased, a bootloader built without
+ * ENABLE_PAGE_CRC gets them written.
+ *
+ * Given the app section the board holds (FlashOptions::oldFlash), only the
+ * pages that changed are sent, as USBTINY_PATCH_PAGE where that is shorter
+ * (patch.h). Every page of it is compared by USBTINY_PAGE_CRC first, the
+ * upload fails without writing anything if the board holds something else.
+ */
+
+#ifndef FLASHER_H_
+#define FLASHER_H_
+
+#include "image.h"
+#include "patch.h"
+#include "transport.h"
+
+struct FlashOptions {
+	unsigned				depth = 4;		// transfers kept queued on the device
+	unsigned				chunk = 0;		// bytes per transfer, 0 for one page
+	bool					verify = false;	// read back and compare every written page
+	bool					exit = true;	// send POWERDOWN at the end, the bootloader then starts the app
+	bool					skipBlank = false;	// leave out blank pages the flash already holds erased
+	const std::vector<uint8_t>	*oldFlash = nullptr;	// the app section the board holds, to send patches against
+	std::vector<uint8_t>	signature;		// expected signature bytes, empty to not check
+};
+
+class Flasher {
+public:
+	Flasher(Bus &bus, Device &dev, const std::vector<Page> &pages, unsigned pageSize, const FlashOptions &opt);
+	Flasher(const Flasher &) = delete;	// queued transfers point back to it
+	Flasher &operator=(const Flasher &) = delete;
+
+	void start();
+	bool finished() const { return inFlight == 0 && (failed || next == steps.size()); }
+	bool ok() const { return finished() && !failed; }
+	const std::string &error() const { return errorText; }
+
+	Device &device() const { return dev; }
+	double progress() const { return totalBytes == 0 ? 1 : (double)doneBytes / totalBytes; }
+	double seconds() const { return endTime - startTime; }
+	size_t bytesWritten() const { return writeBytes; }
+	unsigned blankPagesSkipped() const { return blankSkipped; }
+	unsigned pagesPatched() const { return patched; }
+	unsigned pagesUnchanged() const { return unchanged; }
+
+	// called after every completed transfer
+	std::function<void(Flasher &)>	onProgress;
+
+private:
+	struct Step {
+		uint8_t		request;
+		uint32_t	addr;
+		uint16_t	len;
+		size_t		data;			// offset in runs of what is written, or expected when reading back,
+									// the first page in pageList for PAGE_CRC
+		bool		barrier;		// only sent once everything before it has completed
+	};
+
+	// consecutive pages within one 64 KB segment
+	struct Run {
+		uint32_t	addr;
+		size_t		data;			// offset in runs
+		size_t		len;
+	};
+
+	void addBlankChecks();
+	void addOldFlashChecks();
+	void addWrites();
+	void addPatches();
+	void addExtAddr(uint32_t addr);
+	void addTransfers(uint8_t request, unsigned chunk);
+	void pump();
+	void completed(const Step &s, Transfer &t);
+	void fail(const std::string &text);
+
+	Bus						&bus;
+	Device					&dev;
+	FlashOptions			opt;
+	unsigned				pageSize;
+	unsigned				chunk;
+	std::vector<Page>		pageList;
+	std::vector<bool>		erased;			// blank pages the flash holds erased already
+	bool					writesAdded = false;
+	std::vector<Step>		steps;
+	std::vector<Run>		runList;
+	std::vector<uint8_t>	runs;			// page data of all runs
+	uint16_t				extAddr = 0;	// address bits 16..31 the device will be using
+	size_t					next = 0;
+	unsigned				inFlight = 0;
+	bool					failed = false;
+	std::string				errorText;
+	size_t					totalBytes = 0;
+	size_t					doneBytes = 0;
+	size_t					writeBytes = 0;
+	unsigned				blankSkipped = 0;
+	unsigned				patched = 0;
+	unsigned				unchanged = 0;
+	double					startTime = 0;
+	double					endTime = 0;
+};
+
+#endif
@@ -0,0 +1,58 @@
+/* <avr/eeprom.h> for the host build of the firmware, see ../sim_avr.h */
+
+#ifndef SIM_AVR_EEPROM_H_
+#define SIM_AVR_EEPROM_H_
+
+#include <avr/io.h>
+
+#define SIM_EEPROM_ADDR(p)	((uint16_t)(uintptr_t)(p))
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p)
+{
+	return sim_eeprom_read(SIM_EEPROM_ADDR(p));
+}
+
+static inline uint16_t eeprom_read_word(const uint16_t *p)
+{
+	return sim_eeprom_read(SIM_EEPROM_ADDR(p)) | sim_eeprom_read(SIM_EEPROM_ADDR(p) + 1) << 8;
+}
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		((uint8_t *)dst)[i] = sim_eeprom_read(SIM_EEPROM_ADDR(src) + i);
+	}
+}
+
+static inline void eeprom_write_byte(uint8_t *p, uint8_t b)
+{
+	sim_eeprom_write(SIM_EEPROM_ADDR(p), b);
+}
+
+static inline void eeprom_write_word(uint16_t *p, uint16_t w)
+{
+	sim_eeprom_write(SIM_EEPROM_ADDR(p), w);
+	sim_eeprom_write(SIM_EEPROM_ADDR(p) + 1, w >> 8);
+}
+
+static inline void eeprom_update_byte(uint8_t *p, uint8_t b)
+{
+	if (eeprom_read_byte(p) != b) {
+		eeprom_write_byte(p, b);
+	}
+}
+
+static inline void eeprom_update_word(uint16_t *p, uint16_t w)
+{
+	eeprom_update_byte((uint8_t *)p, w);
+	eeprom_update_byte((uint8_t *)p + 1, w >> 8);
+}
+
+static inline void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		eeprom_update_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+	}
+}
+
+#endif
@@ -0,0 +1,19 @@
+/* <avr/interrupt.h> for the host build of the firmware, see ../sim_avr.h
+ *
+ * SimChip calls the handlers itself. A naked handler is assembly only, it is
+ * left unused and the simulator does what it does.
+ */
+
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector, attributes)	SIM_##attributes(vector)
+#define SIM_ISR_NOBLOCK(vector)	void vector(void)
+#define SIM_ISR_NAKED(vector)	static __attribute__ ((unused)) void sim_naked_##vector(void)
+
+#define sei()	(SREG |= 0x80)
+#define cli()	(SREG &= ~0x80)
+
+#endif
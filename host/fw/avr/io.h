@@ -0,0 +1,151 @@
+/* <avr/io.h> for the host build of the firmware, an ATmega328P, see ../sim_avr.h */
+
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+
+#include "../sim_avr.h"
+
+// int is 16 bits on the AVR, V-USB's string descriptors are arrays of it
+#define int short
+
+#define __AVR_ATmega328P__	1
+
+#define _BV(bit)			(1 << (bit))
+#define _SFR_MEM_ADDR(reg)	0
+#define _SFR_IO_ADDR(reg)	0
+
+#define FLASHEND		0x7FFF
+#define E2END			0x3FF
+#define RAMEND			0x8FF
+#define SPM_PAGESIZE	128
+#define SIGNATURE_0		0x1E
+#define SIGNATURE_1		0x95
+#define SIGNATURE_2		0x0F
+
+#define PINB	sim_io.PINB
+#define DDRB	sim_io.DDRB
+#define PORTB	sim_io.PORTB
+#define PINC	sim_io.PINC
+#define DDRC	sim_io.DDRC
+#define PORTC	sim_io.PORTC
+#define PIND	(*sim_pind())
+#define DDRD	sim_io.DDRD
+#define PORTD	sim_io.PORTD
+#define MCUCR	sim_io.MCUCR
+#define MCUSR	sim_io.MCUSR
+#define SREG	sim_io.SREG
+#define SMCR	sim_io.SMCR
+#define WDTCSR	sim_io.WDTCSR
+#define OSCCAL	sim_io.OSCCAL
+#define EIMSK	sim_io.EIMSK
+#define EIFR	sim_io.EIFR
+#define EICRA	sim_io.EICRA
+#define TCCR1A	sim_io.TCCR1A
+#define TCCR1B	sim_io.TCCR1B
+#define TCNT1	(*sim_tcnt1())
+#define OCR1A	sim_io.OCR1A
+#define TIFR1	sim_io.TIFR1
+#define TIMSK1	sim_io.TIMSK1
+#define UCSR0A	(*sim_ucsr0a())
+#define UCSR0B	sim_io.UCSR0B
+#define UCSR0C	sim_io.UCSR0C
+#define UBRR0L	sim_io.UBRR0L
+#define UBRR0H	sim_io.UBRR0H
+#define UDR0	(*sim_udr0())
+
+#define PORTB5	5
+#define PINB5	5
+#define PB5		5
+#define PD0		0
+#define PD1		1
+#define PD2		2
+#define PD7		7
+#define PIND2	2
+#define PIND7	7
+
+#define PORF	0
+#define EXTRF	1
+#define BORF	2
+#define WDRF	3
+#define IVSEL	1
+#define IVCE	0
+#define PUD		4
+#define INT0	0
+#define INTF0	0
+#define ISC00	0
+#define ISC01	1
+#define TOIE1	0
+#define OCIE1A	1
+#define TOV1	0
+#define OCF1A	1
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define SPMEN	0
+#define PGERS	1
+#define PGWRT	2
+#define BLBSET	3
+#define RWWSRE	4
+#define SIGRD	5
+#define RWWSB	6
+#define SPMIE	7
+#define RXC0	7
+#define TXC0	6
+#define UDRE0	5
+#define FE0		4
+#define DOR0	3
+#define UPE0	2
+#define U2X0	1
+#define MPCM0	0
+#define RXCIE0	7
+#define TXCIE0	6
+#define UDRIE0	5
+#define RXEN0	4
+#define TXEN0	3
+#define UCSZ02	2
+#define UCSZ01	2
+#define UCSZ00	1
+#define WDCE	4
+#define WDE		3
+#define SE		0
+
+#define INT0_vect			sim_int0
+#define TIMER1_COMPA_vect	sim_timer1_compa
+#define TIMER1_OVF_vect		sim_timer1_ovf
+#define USART_RX_vect		sim_usart_rx
+
+// <avr/boot.h>, ../../avr_boot.h is left out, it also brings in <avr/eeprom.h>
+#define _AVR_BOOT_H_	1
+
+#define boot_spm_busy()						sim_spm_busy()
+#define boot_spm_busy_wait()				sim_spm_busy_wait()
+#define boot_page_fill(addr, data)			sim_spm_fill(addr, data)
+#define boot_page_erase(addr)				sim_spm_erase(addr)
+#define boot_page_write(addr)				sim_spm_write(addr)
+#define boot_rww_enable()					sim_spm_rww_enable()
+#define __boot_page_fill_short(addr, data)	sim_spm_fill(addr, data)
+#define __boot_page_erase_short(addr)		sim_spm_erase(addr)
+#define __boot_page_write_short(addr)		sim_spm_write(addr)
+#define __boot_rww_enable_short()			sim_spm_rww_enable()
+#define boot_lock_fuse_bits_get(addr)		sim_lock_fuse_bits(addr)
+#define boot_signature_byte_get(addr)		sim_signature_byte(addr)
+
+#define GET_LOW_FUSE_BITS		0x0000
+#define GET_LOCK_BITS			0x0001
+#define GET_EXTENDED_FUSE_BITS	0x0002
+#define GET_HIGH_FUSE_BITS		0x0003
+
+// what the firmware does in inline assembly
+#define APP_START_JUMP(cause)	sim_app_start(cause)
+#define optiboot_read_flash_inc(ch, address) \
+	((ch) = sim_flash_read(address), (address)++)
+
+#include <avr/eeprom.h>
+
+#endif
@@ -0,0 +1,26 @@
+/* <avr/pgmspace.h> for the host build of the firmware, see ../sim_avr.h
+ *
+ * Addresses within the simulated flash read it, anything above is a host
+ * pointer to a PROGMEM constant, V-USB's descriptors.
+ */
+
+#ifndef SIM_AVR_PGMSPACE_H_
+#define SIM_AVR_PGMSPACE_H_
+
+#include <avr/io.h>
+
+#define PROGMEM
+#define PSTR(s)	(s)
+
+static inline uint8_t sim_pgm_read_byte(uintptr_t addr)
+{
+	return addr <= FLASHEND ? sim_flash_read(addr) : *(const uint8_t *)addr;
+}
+
+#define pgm_read_byte(addr)			sim_pgm_read_byte((uintptr_t)(addr))
+#define pgm_read_word(addr)			(pgm_read_byte(addr) | pgm_read_byte((uintptr_t)(addr) + 1) << 8)
+#define pgm_read_byte_near(addr)	pgm_read_byte(addr)
+#define pgm_read_word_near(addr)	pgm_read_word(addr)
+#define pgm_read_byte_far(addr)		sim_flash_read(addr)
+
+#endif
@@ -0,0 +1,14 @@
+/* <avr/sleep.h> for the host build of the firmware, see ../sim_avr.h */
+
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE		0
+#define set_sleep_mode(mode)	(SMCR = (mode))
+#define sleep_enable()			(SMCR |= _BV(SE))
+#define sleep_disable()			(SMCR &= ~_BV(SE))
+#define sleep_cpu()				sim_sleep()
+
+#endif
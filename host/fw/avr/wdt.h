@@ -0,0 +1,14 @@
+/* <avr/wdt.h> for the host build of the firmware, the watchdog is not simulated */
+
+#ifndef SIM_AVR_WDT_H_
+#define SIM_AVR_WDT_H_
+
+#define WDTO_15MS	0
+#define WDTO_1S		6
+#define WDTO_8S		9
+
+#define wdt_reset()
+#define wdt_disable()
+#define wdt_enable(timeout)
+
+#endif
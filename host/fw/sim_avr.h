@@ -0,0 +1,74 @@
+/* The ATmega328P that ../../main.c, ../../optiboot.c and V-USB run on in the simulator
+ *
+ * The headers in this directory stand in for avr-libc when the firmware is
+ * built for the host. Registers without side effects are plain fields of
+ * sim_io. The others, SPM, EEPROM, delays and sleep go through the hooks
+ * below, implemented by SimChip in ../avrsim.cpp, which also advances time
+ * and runs the Timer1 interrupt from within them.
+ *
+ * UCSR0A and UDR0 are read and written through the same pointer. What a read
+ * returns has SIM_READ set in the high byte, so the next hook call can tell
+ * whether the firmware stored a value there in the meantime.
+ */
+
+#ifndef SIM_AVR_H_
+#define SIM_AVR_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_READ 0x8000
+
+// no padding, the firmware is built with -fpack-struct like on the AVR
+struct sim_io {
+	uint16_t	TCNT1, OCR1A;
+	uint16_t	UCSR0A, UDR0;
+	uint8_t		PINB, DDRB, PORTB;
+	uint8_t		PINC, DDRC, PORTC;
+	uint8_t		PIND, DDRD, PORTD;
+	uint8_t		MCUCR, MCUSR, SREG, SMCR, WDTCSR, OSCCAL;
+	uint8_t		EIMSK, EIFR, EICRA;
+	uint8_t		TCCR1A, TCCR1B, TIFR1, TIMSK1;
+	uint8_t		UCSR0B, UCSR0C, UBRR0L, UBRR0H;
+};
+
+extern struct sim_io sim_io;
+
+// registers with side effects
+volatile uint16_t *sim_tcnt1(void);
+volatile uint8_t *sim_pind(void);
+volatile uint16_t *sim_ucsr0a(void);
+volatile uint16_t *sim_udr0(void);
+
+void sim_delay_us(double us);
+void sim_sleep(void);
+
+// flash, SPM and the signature row
+uint8_t sim_flash_read(uint32_t addr);
+void sim_spm_fill(uint32_t addr, uint16_t data);
+void sim_spm_erase(uint32_t addr);
+void sim_spm_write(uint32_t addr);
+void sim_spm_rww_enable(void);
+uint8_t sim_spm_busy(void);
+void sim_spm_busy_wait(void);
+uint8_t sim_lock_fuse_bits(uint8_t addr);
+uint8_t sim_signature_byte(uint8_t addr);
+
+uint8_t sim_eeprom_read(uint16_t addr);
+void sim_eeprom_write(uint16_t addr, uint8_t data);
+
+// the jump to the app ends the firmware's run
+void sim_app_start(uint8_t r2) __attribute__ ((noreturn));
+
+// the firmware's interrupt handlers
+void sim_timer1_ovf(void);
+void sim_timer1_compa(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
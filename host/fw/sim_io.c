@@ -0,0 +1,5 @@
+/* The simulated chip's registers, swapped with the rest of the firmware's state, see ../avrsim.h */
+
+#include <avr/io.h>
+
+struct sim_io sim_io;
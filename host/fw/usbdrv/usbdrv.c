@@ -0,0 +1,34 @@
+/* V-USB for the host build of the firmware, see ../sim_avr.h
+ *
+ * ../../main.c includes this in place of ../../../usbdrv/usbdrv.c. The
+ * interrupt handler in usbdrvasm.S is SimBus in ../../sim.cpp, which works
+ * on the driver's buffers the same way. Pointers into RAM and PROGMEM are
+ * host pointers, and CRCs are left out, the simulated host does not check them.
+ *
+ * The driver says unsigned for 16 bits, usbWord_t in usbRequest_t relies on
+ * it, so it is made unsigned short while the driver is compiled, like int in
+ * ../avr/io.h. uchar is made a type first, unsigned char would not survive that.
+ */
+
+#undef usbMsgPtr_t
+#define usbMsgPtr_t uintptr_t
+#define uchar uint8_t
+#define unsigned unsigned short
+
+#include "../../../usbdrv/usbdrv.c"
+
+unsigned (usbCrc16)(unsigned data, uchar len)
+{
+	(void)data;
+	(void)len;
+	return 0;
+}
+
+unsigned (usbCrc16Append)(unsigned data, uchar len)
+{
+	(void)data;
+	(void)len;
+	return 0;
+}
+
+#undef unsigned
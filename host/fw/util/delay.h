@@ -0,0 +1,11 @@
+/* <util/delay.h> for the host build of the firmware, delays pass simulated time */
+
+#ifndef SIM_UTIL_DELAY_H_
+#define SIM_UTIL_DELAY_H_
+
+#include <avr/io.h>
+
+#define _delay_us(us)	sim_delay_us(us)
+#define _delay_ms(ms)	sim_delay_us((ms) * 1000.0)
+
+#endif
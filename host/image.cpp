@@ -0,0 +1,111 @@
+/* Intel HEX loader and page coalescing, see image.h */
+
+#include "image.h"
+
+#include <fstream>
+#include <stdexcept>
+
+static unsigned hexByte(const std::string &line, size_t pos)
+{
+	unsigned v = 0;
+
+	for (size_t i = pos; i < pos + 2; i++) {
+		char c = line[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= c - '0';
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else throw std::invalid_argument("bad hex digit");
+	}
+	return v;
+}
+
+// ----------------------------------------------------------------------
+// record types 00 data, 01 end, 02 segment and 04 linear address, 03 and
+// 05 (start address) do not matter for flash and are skipped
+// ----------------------------------------------------------------------
+void Image::loadHex(const std::string &path)
+{
+	std::ifstream in(path);
+	std::string line;
+	uint32_t base = 0;
+	unsigned lineNo = 0;
+
+	if (!in) {
+		throw std::runtime_error(path + ": cannot open");
+	}
+	while (std::getline(in, line)) {
+		lineNo++;
+		while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+			line.pop_back();
+		}
+		if (line.empty()) {
+			continue;
+		}
+		try {
+			if (line[0] != ':' || line.size() < 11 || (line.size() & 1) == 0) {
+				throw std::invalid_argument("not a HEX record");
+			}
+			std::vector<uint8_t> rec;
+			uint8_t sum = 0;
+			for (size_t i = 1; i < line.size(); i += 2) {
+				rec.push_back(hexByte(line, i));
+				sum += rec.back();
+			}
+			if (sum != 0) {
+				throw std::invalid_argument("checksum error");
+			}
+			unsigned len = rec[0];
+			if (rec.size() != len + 5) {
+				throw std::invalid_argument("length does not match");
+			}
+			uint16_t offset = rec[1] << 8 | rec[2];
+			switch (rec[3]) {
+			case 0x00:
+				for (unsigned i = 0; i < len; i++) {
+					set(base + (uint16_t)(offset + i), rec[4 + i]);
+				}
+				break;
+			case 0x01:
+				return;
+			case 0x02:
+				if (len != 2) throw std::invalid_argument("bad segment address record");
+				base = (uint32_t)(rec[4] << 8 | rec[5]) << 4;
+				break;
+			case 0x04:
+				if (len != 2) throw std::invalid_argument("bad linear address record");
+				base = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+				break;
+			case 0x03:
+			case 0x05:
+				break;
+			default:
+				throw std::invalid_argument("unknown record type");
+			}
+		}
+		catch (const std::invalid_argument &e) {
+			throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": " + e.what());
+		}
+	}
+	throw std::runtime_error(path + ": no end of file record");
+}
+
+std::vector<Page> Image::pages(unsigned pageSize) const
+{
+	std::vector<Page> out;
+
+	for (auto it = bytes.begin(); it != bytes.end(); ) {
+		Page page;
+		page.addr = it->first - it->first % pageSize;
+		page.data.assign(pageSize, 0xFF);
+		for (; it != bytes.end() && it->first < page.addr + pageSize; ++it) {
+			page.data[it->first - page.addr] = it->second;
+		}
+		page.blank = true;
+		for (uint8_t b : page.data) {
+			page.blank = page.blank && b == 0xFF;
+		}
+		out.push_back(std::move(page));
+	}
+	return out;
+}
@@ -0,0 +1,35 @@
+/* Flash image loaded from an Intel HEX file, and cut into pages for writing */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Page {
+	uint32_t				addr;		// page aligned byte address
+	std::vector<uint8_t>	data;		// a whole page, bytes the image leaves out are 0xFF
+	bool					blank;		// nothing but 0xFF
+};
+
+class Image {
+public:
+	// throws std::runtime_error with the file and line on malformed input
+	void loadHex(const std::string &path);
+
+	void set(uint32_t addr, uint8_t b) { bytes[addr] = b; }
+	size_t size() const { return bytes.size(); }
+	uint32_t end() const { return bytes.empty() ? 0 : bytes.rbegin()->first + 1; }
+
+	// Coalesces the image into pages, in address order, whatever order the HEX
+	// records came in, so the bootloader commits each page only once. Pages that
+	// hold nothing but 0xFF are kept and marked, the flash may not be erased there.
+	std::vector<Page> pages(unsigned pageSize) const;
+
+private:
+	std::map<uint32_t, uint8_t>	bytes;
+};
+
+#endif
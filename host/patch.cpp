@@ -0,0 +1,142 @@
+/* Patch generator, see patch.h */
+
+#include "patch.h"
+
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+
+namespace {
+
+// the op encoding of USBTINY_PATCH_PAGE, see PATCH_LITERAL and PATCH_COPY in ../main.c
+const unsigned MAX_RUN = 128;
+const unsigned MIN_COPY = 4;		// a copy takes 3 bytes, a shorter one saves nothing
+const unsigned MAX_CANDIDATES = 256;	// old positions tried for one match, 0xFF fill has thousands
+
+uint32_t key(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+class Planner {
+public:
+	Planner(const std::vector<uint8_t> &oldFlash, unsigned pageSize) : old(oldFlash), pageSize(pageSize)
+	{
+		for (size_t i = 0; i + MIN_COPY <= old.size(); i++) {
+			std::vector<uint32_t> &list = index[key(&old[i])];
+			if (list.size() < MAX_CANDIDATES) {
+				list.push_back(i);
+			}
+		}
+	}
+
+	std::vector<uint8_t> patch(const Page &p, const std::set<uint32_t> &rewritten) const;
+
+private:
+	bool usable(uint32_t src, uint32_t page, const std::set<uint32_t> &rewritten) const
+	{
+		uint32_t srcPage = src - src % pageSize;
+		return src < old.size() && (src >> 16) == (page >> 16)
+			&& (srcPage == page || rewritten.count(srcPage) == 0);
+	}
+
+	const std::vector<uint8_t>									&old;
+	const unsigned												pageSize;
+	std::unordered_map<uint32_t, std::vector<uint32_t>>			index;		// positions of every 4 old bytes
+};
+
+void flushLiterals(std::vector<uint8_t> &ops, std::vector<uint8_t> &literals)
+{
+	for (size_t pos = 0; pos < literals.size(); pos += MAX_RUN) {
+		size_t n = std::min<size_t>(MAX_RUN, literals.size() - pos);
+		ops.push_back(n - 1);
+		ops.insert(ops.end(), literals.begin() + pos, literals.begin() + pos + n);
+	}
+	literals.clear();
+}
+
+// ----------------------------------------------------------------------
+// greedy: the longest copy at each position, else a literal byte
+// ----------------------------------------------------------------------
+std::vector<uint8_t> Planner::patch(const Page &p, const std::set<uint32_t> &rewritten) const
+{
+	const std::vector<uint8_t> &data = p.data;
+	std::vector<uint8_t> ops;
+	std::vector<uint8_t> literals;
+
+	for (size_t pos = 0; pos < data.size(); ) {
+		uint32_t bestSrc = 0;
+		size_t bestLen = 0;
+		// the same place in the old page first, the index only holds the first few of common patterns
+		std::vector<uint32_t> candidates(1, p.addr + pos);
+		auto it = pos + MIN_COPY <= data.size() ? index.find(key(&data[pos])) : index.end();
+		if (it != index.end()) {
+			candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+		}
+		for (uint32_t src : candidates) {
+			size_t len = 0;
+			while (pos + len < data.size() && len < MAX_RUN && usable(src + len, p.addr, rewritten)
+				&& old[src + len] == data[pos + len]) {
+				len++;
+			}
+			if (len > bestLen) {
+				bestLen = len;
+				bestSrc = src;
+			}
+		}
+		if (bestLen >= MIN_COPY) {
+			flushLiterals(ops, literals);
+			ops.push_back(0x80 | (bestLen - 1));
+			ops.push_back(bestSrc & 0xFF);
+			ops.push_back(bestSrc >> 8 & 0xFF);
+			pos += bestLen;
+		}
+		else {
+			literals.push_back(data[pos++]);
+		}
+	}
+	flushLiterals(ops, literals);
+	if (ops.size() >= data.size()) {
+		ops.clear();
+	}
+	return ops;
+}
+
+// ----------------------------------------------------------------------
+// patches for the changed pages in the given order, and the bytes they take
+// ----------------------------------------------------------------------
+size_t plan(const Planner &planner, const std::vector<uint8_t> &oldFlash, const std::vector<const Page *> &order,
+	std::vector<PagePatch> &out)
+{
+	std::set<uint32_t> rewritten;
+	size_t bytes = 0;
+
+	for (const Page *p : order) {
+		if (p->addr + p->data.size() <= oldFlash.size()
+			&& std::equal(p->data.begin(), p->data.end(), oldFlash.begin() + p->addr)) {
+			continue;
+		}
+		out.push_back({ p->addr, planner.patch(*p, rewritten) });
+		bytes += out.back().ops.empty() ? p->data.size() : out.back().ops.size();
+		rewritten.insert(p->addr);
+	}
+	return bytes;
+}
+
+}
+
+std::vector<PagePatch> makePatches(const std::vector<uint8_t> &oldFlash, const std::vector<Page> &pages,
+	unsigned pageSize)
+{
+	Planner planner(oldFlash, pageSize);
+	std::vector<const Page *> order;
+	std::vector<PagePatch> up, down;
+
+	for (const Page &p : pages) {
+		order.push_back(&p);
+	}
+	size_t upBytes = plan(planner, oldFlash, order, up);
+	std::reverse(order.begin(), order.end());
+	size_t downBytes = plan(planner, oldFlash, order, down);
+	return downBytes < upBytes ? down : up;
+}
@@ -0,0 +1,26 @@
+/* USBTINY_PATCH_PAGE ops for the pages that changed from an old image
+ *
+ * A patch rebuilds one page from literal bytes and copies of the old flash,
+ * the bootloader reads the copies before it erases the page. So a page may
+ * copy from itself and from every page that is still old, never from one
+ * that was rewritten before it. The pages are planned in ascending and in
+ * descending address order, whichever sends fewer bytes is used, and the
+ * patches have to be sent in that order.
+ */
+
+#ifndef PATCH_H_
+#define PATCH_H_
+
+#include "image.h"
+
+struct PagePatch {
+	uint32_t				addr;
+	std::vector<uint8_t>	ops;		// empty if the page is sent whole, a patch would not be shorter
+};
+
+// The pages that differ from oldFlash (the app section as the board holds it,
+// from address 0), in the order they have to be written.
+std::vector<PagePatch> makePatches(const std::vector<uint8_t> &oldFlash, const std::vector<Page> &pages,
+	unsigned pageSize);
+
+#endif
@@ -0,0 +1,181 @@
+/* Serial lines to optiboot, see serial.h */
+
+#include "serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+speed_t ttySpeed(unsigned baud)
+{
+	switch (baud) {
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	}
+	throw std::runtime_error("unsupported baud rate " + std::to_string(baud));
+}
+
+void sleepSeconds(double s)
+{
+	std::this_thread::sleep_for(std::chrono::duration<double>(s));
+}
+
+}
+
+TtyPort::TtyPort(const std::string &path, unsigned baud) : path(path)
+{
+	termios tio;
+
+	fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		throw std::runtime_error(path + ": " + strerror(errno));
+	}
+	if (tcgetattr(fd, &tio) != 0) {
+		std::string error = path + ": " + strerror(errno);
+		close(fd);
+		throw std::runtime_error(error);
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	try {
+		cfsetispeed(&tio, ttySpeed(baud));
+		cfsetospeed(&tio, ttySpeed(baud));
+	}
+	catch (const std::runtime_error &) {
+		close(fd);
+		throw;
+	}
+	if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+		std::string error = path + ": " + strerror(errno);
+		close(fd);
+		throw std::runtime_error(error);
+	}
+}
+
+TtyPort::~TtyPort()
+{
+	close(fd);
+}
+
+void TtyPort::write(const std::vector<uint8_t> &data)
+{
+	size_t done = 0;
+
+	while (done < data.size()) {
+		ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0 && errno == EAGAIN) {
+			pollfd p = { fd, POLLOUT, 0 };
+			poll(&p, 1, 100);
+		}
+		else if (n < 0 && errno != EINTR) {
+			throw std::runtime_error(path + ": " + strerror(errno));
+		}
+		else if (n > 0) {
+			done += n;
+		}
+	}
+}
+
+int TtyPort::read(double until)
+{
+	while (true) {
+		uint8_t b;
+		ssize_t n = ::read(fd, &b, 1);
+		if (n == 1) {
+			return b;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			throw std::runtime_error(path + ": " + strerror(errno));
+		}
+		double left = until - now();
+		if (left <= 0) {
+			return -1;
+		}
+		pollfd p = { fd, POLLIN, 0 };
+		poll(&p, 1, (int)std::ceil(left * 1000));
+	}
+}
+
+double TtyPort::now()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// ----------------------------------------------------------------------
+// the way avrdude resets an Arduino, then drops what the old app sent
+// ----------------------------------------------------------------------
+void TtyPort::reset()
+{
+	int lines = TIOCM_DTR | TIOCM_RTS;
+
+	ioctl(fd, TIOCMBIC, &lines);
+	sleepSeconds(0.25);
+	ioctl(fd, TIOCMBIS, &lines);
+	sleepSeconds(0.05);
+	tcflush(fd, TCIOFLUSH);
+}
+
+SimSerialPort::SimSerialPort(SimChip &chip, unsigned baud, double latencyMs)
+	: chip(chip), byteTime(10.0 / baud), latency(latencyMs / 1000), time(chip.now()), lineFree(chip.now())
+{
+	chip.onUartTransmit = [this](uint8_t b, double t) {
+		received.push_back({ t + latency, b });
+		lastTx = t;
+	};
+}
+
+// ----------------------------------------------------------------------
+// the bytes leave the adapter back to back once the latency is over
+// ----------------------------------------------------------------------
+void SimSerialPort::write(const std::vector<uint8_t> &data)
+{
+	double t = std::max(time + latency, lineFree);
+
+	for (uint8_t b : data) {
+		t += byteTime;
+		chip.uartReceive(b, t);
+	}
+	lineFree = t;
+}
+
+// ----------------------------------------------------------------------
+// runs the chip a byte time at a time, so it is never further ahead than
+// the host's answer to what it sent could reach it
+// ----------------------------------------------------------------------
+int SimSerialPort::read(double until)
+{
+	while (true) {
+		// within a cycle of until is as far as the chip gets
+		bool all = chip.appStarted() || chip.now() + 1.0 / SimChip::F_CPU > until;
+		if (!received.empty() && received.front().at <= until
+			&& (all || received.front().at <= chip.now() + latency)) {
+			Rx r = received.front();
+			received.pop_front();
+			time = std::max(time, r.at);
+			return r.b;
+		}
+		if (all) {
+			time = std::max(time, until);
+			return -1;
+		}
+		chip.runUntil(std::min(until, chip.now() + byteTime));
+	}
+}
@@ -0,0 +1,74 @@
+/* A serial line to optiboot, the bootloader's UART side
+ *
+ * A SerialPort is read with a deadline, which keeps the upload protocols in
+ * uartflash.h sequential. TtyPort is a real port, usually a USB serial
+ * adapter, SimSerialPort the UART of a simulated chip (avrsim.h) behind a
+ * link with the same latency each way: an adapter holds received bytes back
+ * for up to its latency timer (16 ms by default on an FTDI, 1 ms or less on
+ * many others), and writes go out in the next USB frame at the earliest.
+ */
+
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include "avrsim.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class SerialPort {
+public:
+	virtual ~SerialPort() {}
+	virtual void write(const std::vector<uint8_t> &data) = 0;
+	// the next byte received, or -1 if none came by time until
+	virtual int read(double until) = 0;
+	// seconds since some fixed point, simulated time on a SimSerialPort
+	virtual double now() = 0;
+	// resets the board, the bootloader runs after it
+	virtual void reset() = 0;
+};
+
+class TtyPort : public SerialPort {
+public:
+	TtyPort(const std::string &path, unsigned baud);	// throws std::runtime_error
+	~TtyPort();
+	TtyPort(const TtyPort &) = delete;
+	TtyPort &operator=(const TtyPort &) = delete;
+
+	void write(const std::vector<uint8_t> &data) override;
+	int read(double until) override;
+	double now() override;
+	// pulses DTR and RTS, which the auto reset of an Arduino style board turns into a reset
+	void reset() override;
+
+private:
+	std::string		path;
+	int				fd;
+};
+
+class SimSerialPort : public SerialPort {
+public:
+	SimSerialPort(SimChip &chip, unsigned baud, double latencyMs);
+
+	void write(const std::vector<uint8_t> &data) override;
+	int read(double until) override;
+	double now() override { return time; }
+	void reset() override {}	// the chip was just powered up
+
+	// when the stop bit of the last byte from the chip left TXD
+	double lastTransmit() const { return lastTx; }
+
+private:
+	struct Rx { double at; uint8_t b; };
+
+	SimChip				&chip;
+	const double		byteTime;		// start, 8 data and stop bit
+	const double		latency;
+	double				time;
+	double				lineFree;		// the end of the last byte sent to the chip
+	double				lastTx = -1;
+	std::deque<Rx>		received;		// with the time the host sees them
+};
+
+#endif
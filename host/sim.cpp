@@ -0,0 +1,299 @@
+/* Simulated bootloaders, see sim.h */
+
+#include "sim.h"
+#include "usbtiny.h"
+
+#include <algorithm>
+
+namespace {
+
+const uint8_t USBPID_SETUP = 0x2D;
+const uint8_t USBPID_OUT = 0xE1;
+
+// standard requests used to enumerate
+const uint8_t SET_ADDRESS = 5;
+const uint8_t GET_DESCRIPTOR = 6;
+const uint8_t SET_CONFIGURATION = 9;
+
+const double DEBOUNCE = 0.1;		// a host waits this long after a connect before the reset
+const double RESET = 0.01;			// SE0 on the bus
+const double RESET_RECOVERY = 0.01;	// before the first SETUP
+const double ATTACH_TIMEOUT = 10;
+
+SimChipTiming chipTiming(const SimTiming &t)
+{
+	SimChipTiming c;
+
+	c.eraseMs = t.eraseMs;
+	c.writeMs = t.writeMs;
+	return c;
+}
+
+}
+
+SimDevice::SimDevice(SimBus &bus, unsigned id)
+	: bus(bus), mcu(id, bus.time, chipTiming(bus.timing), 1 << 1)	// EXTRF
+{
+}
+
+bool SimDevice::submit(std::unique_ptr<Transfer> t)
+{
+	if (state == GONE) {
+		return false;
+	}
+	queue.push_back({ std::move(t), bus.time + bus.timing.hostLatencyMs / 1000, -1 });
+	return true;
+}
+
+void SimDevice::control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index, uint16_t len,
+	std::function<void(Transfer &)> done)
+{
+	std::unique_ptr<Transfer> t(new Transfer);
+
+	t->requestType = requestType;
+	t->request = request;
+	t->value = value;
+	t->index = index;
+	t->data.resize(len);
+	t->done = done;
+	queue.push_back({ std::move(t), resetEnd + RESET_RECOVERY, -1 });
+}
+
+// ----------------------------------------------------------------------
+// what a host does with a new device before a driver gets to see it, only
+// the serial number is kept
+// ----------------------------------------------------------------------
+void SimDevice::enumerate()
+{
+	uint8_t address = bus.devs.size() + 1;
+
+	control(0x00, SET_ADDRESS, address, 0, 0, nullptr);
+	control(0x80, GET_DESCRIPTOR, 0x0100, 0, 18, [this](Transfer &t) {
+		if (t.status != 0 || t.data.size() != 18
+			|| (t.data[8] | t.data[9] << 8) != usbtiny::VENDOR_ID
+			|| (t.data[10] | t.data[11] << 8) != usbtiny::PRODUCT_ID || t.data[16] == 0) {
+			gone();
+			return;
+		}
+		control(0x00, SET_CONFIGURATION, 1, 0, 0, nullptr);
+		control(0x80, GET_DESCRIPTOR, 0x0300 | t.data[16], 0x0409, 255, [this](Transfer &s) {
+			if (s.status != 0 || s.data.size() < 2) {
+				gone();
+				return;
+			}
+			// UTF-16LE, the digits are ASCII
+			for (size_t i = 2; i + 1 < s.data.size(); i += 2) {
+				serialNumber += (char)s.data[i];
+			}
+			state = READY;
+		});
+	});
+}
+
+// ----------------------------------------------------------------------
+// runs the firmware through connecting, then the bus reset once the host
+// has seen the pullup for long enough
+// ----------------------------------------------------------------------
+void SimDevice::startFrame(double now)
+{
+	frameTransactions = 0;
+	if (state == ATTACHING || state == RESETTING) {
+		mcu.runUntil(now);
+	}
+	if (state != GONE && (mcu.appStarted() || (state == ATTACHING && now > ATTACH_TIMEOUT))) {
+		gone();
+		return;
+	}
+	if (state == ATTACHING) {
+		if (!mcu.usbAttached()) {
+			attachedSince = -1;
+		}
+		else if (attachedSince < 0) {
+			attachedSince = now;
+		}
+		else if (now - attachedSince >= DEBOUNCE) {
+			resetEnd = now + RESET;
+			mcu.usbReset(now, resetEnd);
+			state = RESETTING;
+		}
+	}
+	else if (state == RESETTING && now >= resetEnd) {
+		state = ENUMERATING;
+		enumerate();
+	}
+}
+
+bool SimDevice::wantsSlot(double now) const
+{
+	return (state == ENUMERATING || state == READY) && !queue.empty() && queue.front().eligible <= now
+		&& frameTransactions < bus.timing.devicePerFrame;
+}
+
+void SimDevice::complete(int status)
+{
+	std::unique_ptr<Transfer> t = std::move(queue.front().t);
+	queue.pop_front();
+	stage = SETUP;
+	t->status = status;
+	bus.completed.push_back(std::move(t));
+}
+
+// ----------------------------------------------------------------------
+// the bootloader started the app or never showed up, it is off the bus
+// ----------------------------------------------------------------------
+void SimDevice::gone()
+{
+	state = GONE;
+	while (!queue.empty()) {
+		complete(-1);
+	}
+}
+
+// ----------------------------------------------------------------------
+// SETUP, then 8-byte DATA packets, then the status stage, one transaction
+// each, the device's main loop runs in between
+// ----------------------------------------------------------------------
+void SimDevice::transact(double now)
+{
+	mcu.runUntil(now);
+	if (mcu.appStarted()) {
+		gone();
+		return;
+	}
+	Queued &q = queue.front();
+	Transfer &t = *q.t;
+	bool in = (t.requestType & 0x80) != 0;
+	SimChip::Handshake h;
+	std::vector<uint8_t> packet;
+
+	if (q.started < 0) {
+		q.started = now;
+	}
+	if (stage == SETUP) {
+		uint16_t len = t.data.size();
+		uint8_t setup[8] = {
+			t.requestType, t.request, (uint8_t)t.value, (uint8_t)(t.value >> 8),
+			(uint8_t)t.index, (uint8_t)(t.index >> 8), (uint8_t)len, (uint8_t)(len >> 8)
+		};
+		h = mcu.usbReceive(USBPID_SETUP, setup, sizeof(setup));
+		if (h == SimChip::ACK) {
+			dataPos = 0;
+			stage = t.data.empty() ? STATUS : DATA;
+		}
+	}
+	else if (stage == DATA && !in) {
+		unsigned len = std::min<unsigned>(usbtiny::PACKET_SIZE, t.data.size() - dataPos);
+		h = mcu.usbReceive(USBPID_OUT, &t.data[dataPos], len);
+		if (h == SimChip::ACK) {
+			dataPos += len;
+			stage = dataPos == t.data.size() ? STATUS : DATA;
+		}
+	}
+	else if (stage == DATA) {
+		h = mcu.usbIn(packet);
+		if (h == SimChip::ACK) {
+			unsigned len = std::min<unsigned>(packet.size(), t.data.size() - dataPos);
+			std::copy_n(packet.begin(), len, t.data.begin() + dataPos);
+			dataPos += len;
+			// a short packet ends the data stage
+			if (packet.size() < usbtiny::PACKET_SIZE || dataPos == t.data.size()) {
+				t.data.resize(dataPos);
+				stage = STATUS;
+			}
+		}
+	}
+	else {
+		// a zero-length packet the other way
+		h = in ? mcu.usbReceive(USBPID_OUT, nullptr, 0) : mcu.usbIn(packet);
+		if (h == SimChip::ACK) {
+			// not GET_DESCRIPTOR, which has the same number
+			if (t.request == usbtiny::POWERDOWN && (t.requestType == usbtiny::REQUEST_IN
+				|| t.requestType == usbtiny::REQUEST_OUT)) {
+				powerdownAt = now;
+			}
+			complete(0);
+			return;
+		}
+	}
+	if (h == SimChip::STALL) {
+		complete(-1);
+	}
+	else if (now - q.started > SimBus::TIMEOUT_MS / 1000.0) {
+		complete(-1);
+	}
+}
+
+SimDevice *SimBus::add()
+{
+	devs.emplace_back(new SimDevice(*this, devs.size()));
+	return devs.back().get();
+}
+
+bool SimBus::attach()
+{
+	auto attaching = [this]() {
+		for (auto &d : devs) {
+			if (d->state != SimDevice::READY && d->state != SimDevice::GONE) {
+				return true;
+			}
+		}
+		return false;
+	};
+	while (attaching()) {
+		handleEvents();
+	}
+	return devices().size() == devs.size();
+}
+
+std::vector<Device *> SimBus::devices()
+{
+	std::vector<Device *> out;
+
+	for (auto &d : devs) {
+		if (d->state == SimDevice::READY) {
+			out.push_back(d.get());
+		}
+	}
+	return out;
+}
+
+// ----------------------------------------------------------------------
+// one frame: each slot goes to the next device in turn that has a
+// transaction ready
+// ----------------------------------------------------------------------
+bool SimBus::handleEvents()
+{
+	bool pending = false;
+
+	for (auto &d : devs) {
+		d->startFrame(time);
+		pending = pending || !d->queue.empty()
+			|| d->state == SimDevice::ATTACHING || d->state == SimDevice::RESETTING;
+	}
+	if (!pending) {
+		return false;
+	}
+
+	for (unsigned slot = 0; slot < timing.busPerFrame; slot++) {
+		double t = time + timing.frameMs / 1000 * slot / timing.busPerFrame;
+		for (size_t i = 0; i < devs.size(); i++) {
+			SimDevice &d = *devs[(rotate + i) % devs.size()];
+			if (d.wantsSlot(t)) {
+				d.transact(t);
+				d.frameTransactions++;
+				rotate = (rotate + i + 1) % devs.size();
+				break;
+			}
+		}
+	}
+	time += timing.frameMs / 1000;
+
+	std::vector<std::unique_ptr<Transfer>> done;
+	done.swap(completed);
+	for (auto &t : done) {
+		if (t->done) {
+			t->done(*t);
+		}
+	}
+	return true;
+}
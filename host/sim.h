@@ -0,0 +1,111 @@
+/* Simulated bootloaders on a simulated low speed bus
+ *
+ * Every SimDevice is a SimChip (avrsim.h) running the real firmware, V-USB
+ * included. SimBus plays the host controller: it resets the bus once a device
+ * has connected, enumerates it and then runs the submitted control transfers
+ * as SETUP, DATA and status transactions, each handed to the chip's USB
+ * interrupt. What the firmware NAKs, or does not answer because it has
+ * interrupts off, is retried in a later slot, so the device only takes
+ * packets as fast as its main loop and the SPM page writes let it.
+ *
+ * A frame holds busPerFrame transaction slots shared by all devices, and one
+ * device gets at most devicePerFrame of them, like a host controller going
+ * through its control queues once per frame. Everything runs in simulated
+ * time, one USB frame per handleEvents() call, so a run is repeatable and
+ * takes no longer than it takes to compute.
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include "avrsim.h"
+#include "transport.h"
+
+#include <deque>
+
+struct SimTiming {
+	double		frameMs = 1.0;			// USB frame
+	unsigned	busPerFrame = 8;		// low speed transactions per frame, all devices together
+	unsigned	devicePerFrame = 1;		// transactions per frame for one device
+	double		eraseMs = 4.0;			// SPM page erase and page write, 3.7 to 4.5 ms on the ATmega328P
+	double		writeMs = 4.0;
+	double		hostLatencyMs = 0.5;	// from a completion to a transfer submitted in its done() being scheduled
+};
+
+class SimBus;
+
+class SimDevice : public Device {
+public:
+	SimDevice(SimBus &bus, unsigned id);
+
+	std::string serial() const override { return serialNumber; }
+	bool submit(std::unique_ptr<Transfer> t) override;
+
+	SimChip &chip() { return mcu; }
+	const std::vector<uint8_t> &flash() const { return mcu.flash; }
+	unsigned pagesProgrammed() const { return mcu.pagesWritten; }
+	bool exited() const { return mcu.appStarted(); }
+	// when the status stage of the POWERDOWN request went through, or a negative time
+	double exitRequested() const { return powerdownAt; }
+
+private:
+	friend class SimBus;
+
+	enum State { ATTACHING, RESETTING, ENUMERATING, READY, GONE };
+
+	void startFrame(double now);
+	bool wantsSlot(double now) const;
+	void transact(double now);
+	void complete(int status);
+	void gone();
+	void enumerate();
+	void control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index, uint16_t len,
+		std::function<void(Transfer &)> done);
+
+	struct Queued {
+		std::unique_ptr<Transfer>	t;
+		double						eligible;	// when the host controller sees it
+		double						started;	// its first transaction, negative before that
+	};
+
+	SimBus					&bus;
+	SimChip					mcu;
+	std::string				serialNumber;
+	State					state = ATTACHING;
+	double					attachedSince = -1;
+	double					resetEnd = 0;
+	double					powerdownAt = -1;
+
+	std::deque<Queued>		queue;
+	enum { SETUP, DATA, STATUS } stage = SETUP;
+	unsigned				dataPos = 0;
+	unsigned				frameTransactions = 0;
+};
+
+class SimBus : public Bus {
+public:
+	explicit SimBus(const SimTiming &timing) : timing(timing) {}
+
+	// powers up another bootloader, with a blank app section unless flash is seeded afterwards
+	SimDevice *add();
+	// runs the bus until every device has enumerated, false if any did not
+	bool attach();
+
+	std::vector<Device *> devices() override;	// the enumerated ones
+	double now() override { return time; }
+	bool handleEvents() override;
+
+	const SimTiming timing;
+
+	static const unsigned TIMEOUT_MS = 5000;	// like UsbBus
+
+private:
+	friend class SimDevice;
+
+	double									time = 0;
+	unsigned								rotate = 0;		// device served first in the next slot
+	std::vector<std::unique_ptr<SimDevice>>	devs;
+	std::vector<std::unique_ptr<Transfer>>	completed;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/* Tests of the Intel HEX loader and the page coalescing, see ../image.h
+ *
+ * Run by make check from host/, the fixtures are read from test/.
+ */
+
+#include "../image.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+// ----------------------------------------------------------------------
+// loads path, which has to fail with message in the error
+// ----------------------------------------------------------------------
+static void checkRejected(const std::string &path, const std::string &message)
+{
+	Image image;
+
+	try {
+		image.loadHex(path);
+		fprintf(stderr, "%s: loaded, expected \"%s\"\n", path.c_str(), message.c_str());
+		failures++;
+	}
+	catch (const std::runtime_error &e) {
+		if (std::string(e.what()).find(message) == std::string::npos) {
+			fprintf(stderr, "%s: \"%s\", expected \"%s\"\n", path.c_str(), e.what(), message.c_str());
+			failures++;
+		}
+	}
+}
+
+// ----------------------------------------------------------------------
+// type 02 and 04 address records, records out of address order, 03 and 05
+// start addresses
+// ----------------------------------------------------------------------
+static void testRecords()
+{
+	Image image;
+
+	image.loadHex("test/records.hex");
+	CHECK(image.size() == 10);
+	CHECK(image.end() == 0x10014);
+
+	std::vector<Page> pages = image.pages(128);
+	CHECK(pages.size() == 3);
+	if (pages.size() != 3) {
+		return;
+	}
+	CHECK(pages[0].addr == 0x80 && pages[0].data[0x7F] == 0x99 && !pages[0].blank);
+	CHECK(pages[0].data[0x7E] == 0xFF);
+	CHECK(pages[1].addr == 0x100 && pages[1].data[0] == 0xAA && pages[1].data[2] == 0xCC);
+	CHECK(pages[2].addr == 0x10000);
+	CHECK(pages[2].data[4] == 0x11 && pages[2].data[5] == 0x22);
+	CHECK(pages[2].data[0x10] == 0xDE && pages[2].data[0x13] == 0xEF);
+	CHECK(pages[2].data[0x14] == 0xFF);
+}
+
+// ----------------------------------------------------------------------
+// the app fixture: shuffled records, two pages of explicit 0xFF and a
+// partial last page behind a segment record
+// ----------------------------------------------------------------------
+static void testApp()
+{
+	Image image;
+
+	image.loadHex("test/app.hex");
+	CHECK(image.end() == 0xB38);
+
+	std::vector<Page> pages = image.pages(128);
+	CHECK(pages.size() == 23);
+	unsigned blank = 0;
+	for (size_t i = 0; i < pages.size(); i++) {
+		CHECK(pages[i].addr == i * 128);
+		CHECK(pages[i].data.size() == 128);
+		blank += pages[i].blank;
+	}
+	CHECK(blank == 2 && pages[12].blank && pages[13].blank);
+	CHECK(pages.back().data[0x38] == 0xFF && pages.back().data[0x7F] == 0xFF);
+}
+
+int main()
+{
+	try {
+		testRecords();
+		testApp();
+	}
+	catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		failures++;
+	}
+	checkRejected("test/bad_checksum.hex", "bad_checksum.hex:2: checksum error");
+	checkRejected("test/bad_length.hex", "bad_length.hex:2: length does not match");
+	checkRejected("test/bad_type.hex", "bad_type.hex:2: unknown record type");
+	checkRejected("test/no_eof.hex", "no end of file record");
+	checkRejected("test/missing.hex", "cannot open");
+
+	if (failures != 0) {
+		fprintf(stderr, "image_test: %u failed\n", failures);
+		return 1;
+	}
+	printf("image_test: ok\n");
+	return 0;
+}
@@ -0,0 +1,144 @@
+/* Tests of the patch generator, see ../patch.h
+ *
+ * The patches are applied in order to a copy of the old flash the way the
+ * bootloader does, a copy from a page that was already rewritten would
+ * bring in the wrong bytes. Run by make check from host/.
+ */
+
+#include "../patch.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static const unsigned PAGE_SIZE = 128;
+static const unsigned APP_SIZE = 0x7000;
+
+static std::vector<uint8_t> appSection(const std::vector<Page> &pages)
+{
+	std::vector<uint8_t> flash(APP_SIZE, 0xFF);
+
+	for (const Page &p : pages) {
+		std::copy(p.data.begin(), p.data.end(), flash.begin() + p.addr);
+	}
+	return flash;
+}
+
+static std::vector<Page> load(const char *path)
+{
+	Image image;
+
+	image.loadHex(path);
+	return image.pages(PAGE_SIZE);
+}
+
+// ----------------------------------------------------------------------
+// rebuilds a page from ops like patch_op() in ../../main.c, false if they
+// do not fill it exactly
+// ----------------------------------------------------------------------
+static bool apply(std::vector<uint8_t> &flash, const PagePatch &p, const std::vector<uint8_t> &whole)
+{
+	std::vector<uint8_t> page;
+
+	if (p.ops.empty()) {
+		page = whole;
+	}
+	for (size_t i = 0; i < p.ops.size(); ) {
+		unsigned n = (p.ops[i] & 0x7F) + 1;
+		if ((p.ops[i] & 0x80) == 0) {
+			if (i + 1 + n > p.ops.size()) {
+				return false;
+			}
+			page.insert(page.end(), p.ops.begin() + i + 1, p.ops.begin() + i + 1 + n);
+			i += 1 + n;
+		}
+		else {
+			if (i + 3 > p.ops.size()) {
+				return false;
+			}
+			uint32_t src = p.ops[i + 1] | p.ops[i + 2] << 8;
+			if (src + n > flash.size()) {
+				return false;
+			}
+			page.insert(page.end(), flash.begin() + src, flash.begin() + src + n);
+			i += 3;
+		}
+	}
+	if (page.size() != PAGE_SIZE) {
+		return false;
+	}
+	std::copy(page.begin(), page.end(), flash.begin() + p.addr);
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// from the board holding oldPath to it holding newPath, returns the bytes sent
+// ----------------------------------------------------------------------
+static size_t checkUpdate(const char *oldPath, const char *newPath)
+{
+	std::vector<Page> pages = load(newPath);
+	std::vector<uint8_t> flash = appSection(load(oldPath));
+	std::vector<PagePatch> patches = makePatches(flash, pages, PAGE_SIZE);
+	size_t bytes = 0;
+
+	for (const PagePatch &p : patches) {
+		const Page *page = nullptr;
+		for (const Page &q : pages) {
+			page = q.addr == p.addr ? &q : page;
+		}
+		CHECK(page != nullptr);
+		CHECK(p.ops.size() < PAGE_SIZE);
+		if (page == nullptr || !apply(flash, p, page->data)) {
+			fprintf(stderr, "%s to %s: the patch for 0x%04x does not fill the page\n", oldPath, newPath, p.addr);
+			failures++;
+			return 0;
+		}
+		bytes += p.ops.empty() ? PAGE_SIZE : p.ops.size();
+	}
+	for (const Page &p : pages) {
+		CHECK(std::equal(p.data.begin(), p.data.end(), flash.begin() + p.addr));
+	}
+	return bytes;
+}
+
+int main()
+{
+	try {
+		// app2 has bytes inserted, the pages after it copy from lower ones: only descending order works
+		size_t up = checkUpdate("test/app.hex", "test/app2.hex");
+		CHECK(up > 0 && up < 512);
+		// and back, the bytes removed: ascending
+		size_t down = checkUpdate("test/app2.hex", "test/app.hex");
+		CHECK(down > 0 && down < 512);
+		// nothing changed, nothing to send
+		CHECK(makePatches(appSection(load("test/app.hex")), load("test/app.hex"), PAGE_SIZE).empty());
+		// nothing to copy from but 0xFF, every page is sent whole except the last, half empty one
+		std::vector<uint8_t> blank(APP_SIZE, 0xFF);
+		std::vector<Page> pages = load("test/app.hex");
+		unsigned whole = 0;
+		for (const PagePatch &p : makePatches(blank, pages, PAGE_SIZE)) {
+			whole += p.ops.empty();
+		}
+		CHECK(whole == pages.size() - 3);	// and the two blank pages are unchanged
+	}
+	catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		failures++;
+	}
+
+	if (failures != 0) {
+		fprintf(stderr, "patch_test: %u failed\n", failures);
+		return 1;
+	}
+	printf("patch_test: ok\n");
+	return 0;
+}
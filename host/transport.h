@@ -0,0 +1,46 @@
+/* Asynchronous control transfers to one or more bootloaders
+ *
+ * A Bus drives every device opened on it from one event loop, like a libusb
+ * context. Transfers submitted to a Device complete in order, each one calling
+ * its done() from within Bus::handleEvents(), which may submit more.
+ * UsbBus (usb.h) talks to real boards, SimBus (sim.h) to simulated ones.
+ */
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Transfer {
+	uint8_t					requestType;	// usbtiny::REQUEST_OUT or REQUEST_IN
+	uint8_t					request;
+	uint16_t				value;
+	uint16_t				index;
+	std::vector<uint8_t>	data;			// OUT data, or sized to wLength for IN and cut to what was received
+	int						status = 0;		// 0, or negative if the transfer failed
+	std::function<void(Transfer &)>	done;
+};
+
+class Device {
+public:
+	virtual ~Device() {}
+	virtual std::string serial() const = 0;
+	// false if the transfer could not be queued, done() is not called then
+	virtual bool submit(std::unique_ptr<Transfer> t) = 0;
+};
+
+class Bus {
+public:
+	virtual ~Bus() {}
+	virtual std::vector<Device *> devices() = 0;
+	// seconds since some fixed point, simulated time on a SimBus
+	virtual double now() = 0;
+	// waits for transfers to complete and calls their done(), false once none are pending
+	virtual bool handleEvents() = 0;
+};
+
+#endif
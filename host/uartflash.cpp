@@ -0,0 +1,229 @@
+/* Uploads through optiboot, see uartflash.h */
+
+#include "uartflash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+namespace {
+
+// ../stk500.h
+const uint8_t STK_OK = 0x10;
+const uint8_t STK_INSYNC = 0x14;
+const uint8_t CRC_EOP = 0x20;
+const uint8_t STK_GET_SYNC = 0x30;
+const uint8_t STK_LEAVE_PROGMODE = 0x51;
+const uint8_t STK_LOAD_ADDRESS = 0x55;
+const uint8_t STK_PROG_PAGE = 0x64;
+
+// ../optiboot.h
+const uint8_t STK_FRAME_MODE = 0x46;
+const uint8_t FRAME_SOF = 0x7E;
+const uint8_t FRAME_ACK = 0x06;
+const uint8_t FRAME_NAK = 0x15;
+
+const double SYNC_TIMEOUT = 2.0;	// after the reset, the bootloader has to answer by then
+const double SYNC_RETRY = 0.1;		// between two STK_GET_SYNC, and quiet after the answer
+const double REPLY_TIMEOUT = 1.0;	// OPTIBOOT_UART_TIMEOUT
+const double RESEND_TIMEOUT = 0.5;	// a whole window plus the round trip, with room to spare
+const unsigned MAX_TRIES = 5;		// sends of one frame
+
+// _crc_ccitt_update() from avr-libc
+uint16_t crcCcitt(uint16_t crc, uint8_t b)
+{
+	crc ^= b;
+	for (int i = 0; i < 8; i++) {
+		crc = (crc & 1) != 0 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	return crc;
+}
+
+std::string hex(uint32_t v)
+{
+	char s[16];
+
+	snprintf(s, sizeof(s), "0x%04x", v);
+	return s;
+}
+
+}
+
+UartFlasher::UartFlasher(SerialPort &port, const std::vector<Page> &pages, bool frameMode)
+	: port(port), pages(pages), frames(frameMode)
+{
+}
+
+bool UartFlasher::run()
+{
+	try {
+		for (const Page &p : pages) {
+			if (p.addr + p.data.size() > 0x20000 || p.data.size() > 255) {
+				throw std::runtime_error("page " + hex(p.addr) + " is out of reach of optiboot's 16 bit word addresses");
+			}
+		}
+		port.reset();
+		sync();
+		startTime = port.now();
+		unsigned window = 0;
+		if (frames) {
+			// a plain optiboot answers STK_INSYNC STK_OK, one with frame mode puts its window in between
+			port.write({ STK_FRAME_MODE, CRC_EOP });
+			expect(STK_INSYNC);
+			int b = port.read(port.now() + REPLY_TIMEOUT);
+			if (b < 0) {
+				throw std::runtime_error("no reply to STK_FRAME_MODE");
+			}
+			frames = b != STK_OK;
+			window = std::max(b, 1);
+		}
+		if (frames) {
+			expect(STK_OK);
+			frameMode(window);
+		}
+		else {
+			stk500v1();
+		}
+		endTime = port.now();
+	}
+	catch (const std::runtime_error &e) {
+		errorText = e.what();
+	}
+	return ok();
+}
+
+// ----------------------------------------------------------------------
+// STK_GET_SYNC until it is answered, then the answers to the ones that
+// were still on their way are dropped
+// ----------------------------------------------------------------------
+void UartFlasher::sync()
+{
+	double end = port.now() + SYNC_TIMEOUT;
+
+	while (port.now() < end) {
+		port.write({ STK_GET_SYNC, CRC_EOP });
+		double retry = port.now() + SYNC_RETRY;
+		int last = -1, b;
+		while ((b = port.read(retry)) >= 0) {
+			if (last == STK_INSYNC && b == STK_OK) {
+				while (port.read(port.now() + SYNC_RETRY) >= 0);
+				return;
+			}
+			last = b;
+		}
+	}
+	throw std::runtime_error("no answer to STK_GET_SYNC, is the board running optiboot?");
+}
+
+void UartFlasher::expect(uint8_t b)
+{
+	int r = port.read(port.now() + REPLY_TIMEOUT);
+
+	if (r < 0) {
+		throw std::runtime_error("no reply");
+	}
+	if (r != b) {
+		throw std::runtime_error("reply " + hex(r) + " instead of " + hex(b));
+	}
+}
+
+void UartFlasher::command(const std::vector<uint8_t> &c)
+{
+	port.write(c);
+	expect(STK_INSYNC);
+	expect(STK_OK);
+}
+
+void UartFlasher::stk500v1()
+{
+	for (const Page &p : pages) {
+		uint16_t word = p.addr / 2;
+		uint16_t len = p.data.size();
+		std::vector<uint8_t> c = { STK_PROG_PAGE, (uint8_t)(len >> 8), (uint8_t)len, 'F' };
+
+		command({ STK_LOAD_ADDRESS, (uint8_t)word, (uint8_t)(word >> 8), CRC_EOP });
+		c.insert(c.end(), p.data.begin(), p.data.end());
+		c.push_back(CRC_EOP);
+		command(c);
+		writeBytes += len;
+	}
+	command({ STK_LEAVE_PROGMODE, CRC_EOP });
+}
+
+void UartFlasher::sendFrame(uint8_t seq, uint32_t addr, const std::vector<uint8_t> &data)
+{
+	uint16_t word = addr / 2;
+	std::vector<uint8_t> f = { FRAME_SOF, seq, (uint8_t)word, (uint8_t)(word >> 8), (uint8_t)data.size() };
+	uint16_t crc = 0xFFFF;
+
+	f.insert(f.end(), data.begin(), data.end());
+	for (size_t i = 1; i < f.size(); i++) {
+		crc = crcCcitt(crc, f[i]);
+	}
+	f.push_back(crc & 0xFF);
+	f.push_back(crc >> 8);
+	port.write(f);
+}
+
+// ----------------------------------------------------------------------
+// page i goes out as frame i & 0xFF, the window keeps the numbers of the
+// outstanding ones apart, then a frame without data ends the session
+// ----------------------------------------------------------------------
+void UartFlasher::frameMode(unsigned window)
+{
+	struct Sent { size_t page; double at; };
+	std::vector<Sent> outstanding;
+	std::vector<unsigned> tries(pages.size() + 1, 0);
+	size_t next = 0;
+	std::vector<uint8_t> none;
+
+	auto send = [&](Sent &s) {
+		if (++tries[s.page] > MAX_TRIES) {
+			throw std::runtime_error(s.page < pages.size() ? "page " + hex(pages[s.page].addr) + " not acknowledged"
+				: "end of session not acknowledged");
+		}
+		resent += tries[s.page] > 1;
+		sendFrame(s.page & 0xFF, s.page < pages.size() ? pages[s.page].addr : 0,
+			s.page < pages.size() ? pages[s.page].data : none);
+		s.at = port.now();
+	};
+
+	while (next <= pages.size() || !outstanding.empty()) {
+		// the end frame only once everything else was acknowledged
+		while (outstanding.size() < window && (next < pages.size() || (next == pages.size() && outstanding.empty()))) {
+			outstanding.push_back({ next++, 0 });
+			send(outstanding.back());
+		}
+		double deadline = outstanding.front().at;
+		for (const Sent &s : outstanding) {
+			deadline = std::min(deadline, s.at);
+		}
+		int b = port.read(deadline + RESEND_TIMEOUT);
+		if (b < 0) {
+			for (Sent &s : outstanding) {
+				if (s.at + RESEND_TIMEOUT <= port.now()) {
+					send(s);
+				}
+			}
+			continue;
+		}
+		if (b != FRAME_ACK && b != FRAME_NAK) {
+			continue;
+		}
+		int seq = port.read(port.now() + REPLY_TIMEOUT);
+		auto it = std::find_if(outstanding.begin(), outstanding.end(),
+			[seq](const Sent &s) { return (int)(s.page & 0xFF) == seq; });
+		if (it == outstanding.end()) {
+			// the answer to a frame sent twice
+		}
+		else if (b == FRAME_ACK) {
+			if (it->page < pages.size()) {
+				writeBytes += pages[it->page].data.size();
+			}
+			outstanding.erase(it);
+		}
+		else {
+			send(*it);
+		}
+	}
+}
@@ -0,0 +1,60 @@
+/* Uploads through optiboot on the bootloader's UART
+ *
+ * Both protocols start like avrdude -c arduino: the board is reset and
+ * STK_GET_SYNC is repeated until the bootloader answers, which on this
+ * bootloader is only once its USB disconnect is over.
+ *
+ * STK500v1 is stop-and-wait: STK_LOAD_ADDRESS and STK_PROG_PAGE for every
+ * page, each waiting for its STK_INSYNC STK_OK, so every page costs two round
+ * trips through the serial adapter on top of its bytes.
+ *
+ * Frame mode (OPTIBOOT_FRAME_MODE in ../optiboot.h) sends CRC-CCITT checked
+ * page frames and keeps up to the bootloader's window of them outstanding,
+ * the bootloader programs a page in the background while the next frame comes
+ * in. A NAKed frame is resent, so is one that was not acknowledged within
+ * half a second. A bootloader without frame mode gets STK500v1.
+ *
+ * Pages are sent whole and in address order, at most 128 KB of them since
+ * both protocols take 16 bit word addresses here.
+ */
+
+#ifndef UARTFLASH_H_
+#define UARTFLASH_H_
+
+#include "image.h"
+#include "serial.h"
+
+class UartFlasher {
+public:
+	UartFlasher(SerialPort &port, const std::vector<Page> &pages, bool frameMode);
+
+	// resets the board and uploads, returns ok()
+	bool run();
+	bool ok() const { return errorText.empty(); }
+	const std::string &error() const { return errorText; }
+
+	bool usedFrameMode() const { return frames; }
+	// from the bootloader's answer to the sync to the reply to the last command
+	double seconds() const { return endTime - startTime; }
+	size_t bytesWritten() const { return writeBytes; }
+	unsigned framesResent() const { return resent; }
+
+private:
+	void sync();
+	void expect(uint8_t b);
+	void command(const std::vector<uint8_t> &c);
+	void stk500v1();
+	void frameMode(unsigned window);
+	void sendFrame(uint8_t seq, uint32_t addr, const std::vector<uint8_t> &data);
+
+	SerialPort					&port;
+	const std::vector<Page>		&pages;
+	bool						frames;
+	std::string					errorText;
+	double						startTime = 0;
+	double						endTime = 0;
+	size_t						writeBytes = 0;
+	unsigned					resent = 0;
+};
+
+#endif
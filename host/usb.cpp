@@ -0,0 +1,171 @@
+/* Bootloaders on real USB, see usb.h */
+
+#include "usb.h"
+#include "usbtiny.h"
+
+#include <libusb.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+// what a submitted transfer carries through libusb
+struct UsbPending {
+	UsbBus						*bus;
+	std::unique_ptr<Transfer>	t;
+};
+
+static double steadySeconds()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+void LIBUSB_CALL transferDone(libusb_transfer *x)
+{
+	UsbPending *p = (UsbPending *)x->user_data;
+	Transfer &t = *p->t;
+
+	if (x->status == LIBUSB_TRANSFER_COMPLETED) {
+		t.status = 0;
+		if ((t.requestType & LIBUSB_ENDPOINT_IN) != 0) {
+			unsigned char *data = libusb_control_transfer_get_data(x);
+			t.data.assign(data, data + x->actual_length);
+		}
+	}
+	else {
+		t.status = -(int)x->status;
+	}
+	p->bus->pending--;
+	if (t.done) {
+		t.done(t);
+	}
+	delete p;
+}
+
+UsbDevice::UsbDevice(UsbBus &bus, libusb_device_handle *handle, const std::string &serial)
+	: bus(bus), handle(handle), serialNumber(serial)
+{
+}
+
+UsbDevice::~UsbDevice()
+{
+	libusb_close(handle);
+}
+
+bool UsbDevice::submit(std::unique_ptr<Transfer> t)
+{
+	libusb_transfer *x = libusb_alloc_transfer(0);
+	size_t len = t->data.size();
+	unsigned char *buf = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+
+	if (x == nullptr || buf == nullptr) {
+		libusb_free_transfer(x);
+		free(buf);
+		return false;
+	}
+	libusb_fill_control_setup(buf, t->requestType, t->request, t->value, t->index, len);
+	if ((t->requestType & LIBUSB_ENDPOINT_IN) == 0 && len != 0) {
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, t->data.data(), len);
+	}
+	UsbPending *p = new UsbPending { &bus, std::move(t) };
+	libusb_fill_control_transfer(x, handle, buf, transferDone, p, UsbBus::TIMEOUT_MS);
+	x->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	if (libusb_submit_transfer(x) != 0) {
+		delete p;
+		libusb_free_transfer(x);
+		return false;
+	}
+	bus.pending++;
+	return true;
+}
+
+UsbBus::UsbBus()
+{
+	int r = libusb_init(&ctx);
+
+	if (r != 0) {
+		throw std::runtime_error(std::string("libusb_init: ") + libusb_error_name(r));
+	}
+	epoch = steadySeconds();
+}
+
+UsbBus::~UsbBus()
+{
+	// transfers still queued would call back into closed devices
+	while (pending != 0) {
+		timeval tv = { 0, 100000 };
+		if (libusb_handle_events_timeout_completed(ctx, &tv, nullptr) < 0) {
+			break;
+		}
+	}
+	devs.clear();
+	libusb_exit(ctx);
+}
+
+void UsbBus::open(const std::vector<std::string> &serials)
+{
+	libusb_device **list;
+	ssize_t n = libusb_get_device_list(ctx, &list);
+
+	if (n < 0) {
+		throw std::runtime_error(std::string("libusb_get_device_list: ") + libusb_error_name((int)n));
+	}
+	for (ssize_t i = 0; i < n; i++) {
+		libusb_device_descriptor desc;
+		libusb_device_handle *h;
+		unsigned char serial[64];
+
+		if (libusb_get_device_descriptor(list[i], &desc) != 0
+			|| desc.idVendor != usbtiny::VENDOR_ID || desc.idProduct != usbtiny::PRODUCT_ID
+			|| desc.iSerialNumber == 0) {
+			continue;
+		}
+		int r = libusb_open(list[i], &h);
+		if (r != 0) {
+			fprintf(stderr, "bus %u device %u: %s\n", libusb_get_bus_number(list[i]),
+				libusb_get_device_address(list[i]), libusb_error_name(r));
+			continue;
+		}
+		r = libusb_get_string_descriptor_ascii(h, desc.iSerialNumber, serial, sizeof(serial));
+		if (r < 0 || (!serials.empty()
+			&& std::find(serials.begin(), serials.end(), std::string((char *)serial, r)) == serials.end())) {
+			libusb_close(h);
+			continue;
+		}
+		devs.emplace_back(new UsbDevice(*this, h, std::string((char *)serial, r)));
+	}
+	libusb_free_device_list(list, 1);
+}
+
+std::vector<Device *> UsbBus::devices()
+{
+	std::vector<Device *> out;
+
+	for (auto &d : devs) {
+		out.push_back(d.get());
+	}
+	return out;
+}
+
+double UsbBus::now()
+{
+	return steadySeconds() - epoch;
+}
+
+bool UsbBus::handleEvents()
+{
+	if (pending == 0) {
+		return false;
+	}
+	timeval tv = { 0, 100000 };
+	int r = libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+	if (r != 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+		throw std::runtime_error(std::string("libusb_handle_events: ") + libusb_error_name(r));
+	}
+	return true;
+}
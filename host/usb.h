@@ -0,0 +1,53 @@
+/* Bootloaders on real USB, through the libusb-1.0 async API */
+
+#ifndef USB_H_
+#define USB_H_
+
+#include "transport.h"
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+class UsbBus;
+
+class UsbDevice : public Device {
+public:
+	UsbDevice(UsbBus &bus, libusb_device_handle *handle, const std::string &serial);
+	~UsbDevice();
+
+	std::string serial() const override { return serialNumber; }
+	bool submit(std::unique_ptr<Transfer> t) override;
+
+private:
+	UsbBus					&bus;
+	libusb_device_handle	*handle;
+	std::string				serialNumber;
+};
+
+class UsbBus : public Bus {
+public:
+	UsbBus();	// throws std::runtime_error
+	~UsbBus();
+
+	// Opens every bootloader, or only those whose serial number is listed. A
+	// USBtinyISP programmer has the same IDs but no serial number, it is skipped.
+	void open(const std::vector<std::string> &serials);
+
+	std::vector<Device *> devices() override;
+	double now() override;
+	bool handleEvents() override;
+
+	static const unsigned TIMEOUT_MS = 5000;
+
+private:
+	friend class UsbDevice;
+	friend void transferDone(libusb_transfer *x);
+
+	libusb_context							*ctx = nullptr;
+	std::vector<std::unique_ptr<UsbDevice>>	devs;
+	unsigned								pending = 0;
+	double									epoch;
+};
+
+#endif
@@ -0,0 +1,45 @@
+/* Host side of the bootloader's USBtiny vendor protocol
+ *
+ * The request numbers and limits below mirror the enum and usbFunctionSetup()
+ * in ../main.c, see also "USB protocol for host tools" in ../Readme.md.
+ */
+
+#ifndef USBTINY_H_
+#define USBTINY_H_
+
+#include <stdint.h>
+
+namespace usbtiny {
+
+const uint16_t VENDOR_ID = 0x1781;		// USBtinyISP, see USB_CFG_VENDOR_ID in ../usbconfig.h
+const uint16_t PRODUCT_ID = 0x0C9F;
+
+const uint8_t REQUEST_OUT = 0x40;		// vendor request, host to device
+const uint8_t REQUEST_IN = 0xC0;		// vendor request, device to host
+
+enum Request {
+	POWERDOWN = 6,			// finish the page being written and start the app
+	SPI = 7,				// ISP command in wValue/wIndex, the answer is the 4th byte
+	FLASH_READ = 9,			// wIndex:address
+	FLASH_WRITE = 10,		// wIndex:address
+	EEPROM_READ = 11,
+	EEPROM_WRITE = 12,
+	EXT_ADDR = 0x40,		// wIndex:address bits 16..31
+	CONFIG_WRITE,
+	BOOT_STATS,
+	PAGE_CRC,
+	PATCH_PAGE,
+	JOURNAL_BEGIN,
+	JOURNAL_READ,
+	VERIFY_STATUS,
+};
+
+// the bootloader keeps the length of a transfer in a byte
+const unsigned MAX_TRANSFER = 255;
+
+// low speed endpoint 0 packets
+const unsigned PACKET_SIZE = 8;
+
+}
+
+#endif
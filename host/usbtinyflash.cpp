@@ -0,0 +1,558 @@
+/* usbtinyflash, writes an Intel HEX file through the bootloader's USBtiny protocol
+ *
+ * Flashes every bootloader found (or those picked with -u) at the same time,
+ * keeping several control transfers queued on each (-d), sends whole pages and
+ * with -k skips the ones that only hold 0xFF where the flash is already
+ * erased. With -P only the pages that changed from the old image the boards
+ * hold are sent, patched from the old flash where that is shorter. With -s simulated bootloaders, the real
+ * firmware running on simulated chips (sim.h), stand in for the boards, their
+ * app section holding an old app (-o, or made up), -S runs the simulation for queue depths 1 to 8 to show how
+ * much pipelining the bootloader's page cache can make use of, -T for 1 to 32
+ * devices to show how a production line scales.
+ *
+ * With -U the image goes through optiboot on a serial port instead (uartflash.h),
+ * STK500v1 or with -F in frame mode, -R simulates both for a range of serial
+ * adapter latencies.
+ */
+
+#include "flasher.h"
+#include "sim.h"
+#include "uartflash.h"
+#include "usbtiny.h"
+#ifndef NO_LIBUSB
+#include "usb.h"
+#endif
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+struct Options {
+	unsigned		pageSize = 128;
+	unsigned		flashSize = 32768;
+	unsigned		bootSize = 4096;		// the top of flash is the bootloader's
+	bool			simulate = false;
+	bool			sweep = false;
+	bool			scale = false;
+	bool			quiet = false;
+	unsigned		simDevices = 1;
+	const char		*oldImage = nullptr;	// what the simulated boards hold before
+	const char		*patchImage = nullptr;	// what the boards hold, to send patches against
+	std::vector<uint8_t>	patchFlash;
+	bool			compare = false;
+	const char		*tty = nullptr;			// upload through optiboot on this serial port
+	bool			frameMode = false;
+	unsigned		baud = 115200;
+	bool			uartSweep = false;
+	std::vector<std::string>	serials;
+	FlashOptions	flash;
+	SimTiming		timing;
+};
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: usbtinyflash [options] image.hex\n"
+		"  -d n   transfers kept queued on the device (4)\n"
+		"  -c n   bytes per transfer, at most 255 (one page)\n"
+		"  -p n   flash page size (128)\n"
+		"  -f n   flash size (32768)\n"
+		"  -m sig expected signature bytes in hex, none to not check (1e950f)\n"
+		"  -P hex send only what changed from this image, which the boards hold\n"
+		"         (needs ENABLE_PAGE_CRC and ENABLE_PATCHING)\n"
+		"  -k     skip pages that only hold 0xFF if the flash is erased there (needs ENABLE_PAGE_CRC)\n"
+		"  -V     read back and compare every written page\n"
+		"  -U tty upload through optiboot on this serial port instead of USB, STK500v1\n"
+		"  -F     with -U, in optiboot's frame mode (OPTIBOOT_FRAME_MODE)\n"
+		"  -B n   baud rate for -U (115200)\n"
+		"  -n     stay in the bootloader, do not send POWERDOWN\n"
+		"  -u sn  only flash the bootloader with this serial number, can be repeated\n"
+		"  -q     no progress, only the results\n"
+		"  -s     use simulated bootloaders instead of USB\n"
+		"  -N n   number of simulated bootloaders (1)\n"
+		"  -S     simulate queue depths 1 to 8 and compare\n"
+		"  -T     simulate 1 to 32 bootloaders and compare\n"
+		"  -C     simulate a full upload and one patched against -P and compare\n"
+		"  -R     simulate UART uploads by STK500v1 and in frame mode for serial adapter\n"
+		"         latencies of 0 to 16 ms each way and compare\n"
+		"simulation:\n"
+		"  -o hex app the simulated boards hold before, -P or a made up one by default\n"
+		"  -e ms  page erase time (4)\n"
+		"  -w ms  page write time (4)\n"
+		"  -l ms  host latency from a completion to the next transfer (0.5)\n"
+		"  -b n   low speed transactions per frame on the bus (8)\n"
+		"  -t n   transactions per frame one device keeps up with (1)\n");
+	exit(2);
+}
+
+static std::vector<uint8_t> parseSignature(const char *s)
+{
+	std::vector<uint8_t> sig;
+
+	if (std::string(s) == "none") {
+		return sig;
+	}
+	for (; s[0] != 0 && s[1] != 0; s += 2) {
+		sig.push_back(strtoul(std::string(s, 2).c_str(), nullptr, 16));
+	}
+	return sig;
+}
+
+// ----------------------------------------------------------------------
+// prints a line each time a device gets another 10 % further
+// ----------------------------------------------------------------------
+static void showProgress(Flasher &f, Bus &bus, std::vector<int> &shown, size_t index)
+{
+	int step = (int)(f.progress() * 10);
+
+	if (step > shown[index] && !f.finished()) {
+		shown[index] = step;
+		printf("%s: %3d %%  %6.2f s\n", f.device().serial().c_str(), step * 10, bus.now());
+	}
+}
+
+// ----------------------------------------------------------------------
+// flashes all devices on the bus at once, returns when all are done
+// ----------------------------------------------------------------------
+static std::vector<std::unique_ptr<Flasher>> run(Bus &bus, const std::vector<Page> &pages,
+	unsigned pageSize, const FlashOptions &opt, bool progress)
+{
+	std::vector<std::unique_ptr<Flasher>> flashers;
+	std::vector<int> shown;
+
+	for (Device *d : bus.devices()) {
+		flashers.emplace_back(new Flasher(bus, *d, pages, pageSize, opt));
+		shown.push_back(0);
+	}
+	for (size_t i = 0; i < flashers.size() && progress; i++) {
+		Flasher *f = flashers[i].get();
+		f->onProgress = [f, &bus, &shown, i](Flasher &) { showProgress(*f, bus, shown, i); };
+	}
+	for (auto &f : flashers) {
+		f->start();
+	}
+	while (bus.handleEvents());
+	for (auto &f : flashers) {
+		f->onProgress = nullptr;
+	}
+	return flashers;
+}
+
+// ----------------------------------------------------------------------
+// the simulated board has to start the app, within a second of POWERDOWN
+// or once the bootloader's USB timeout (10 s) is over, its flash then has
+// to hold the image, whatever the device reported, and the firmware must
+// not have misused SPM on the way or left it running for the app
+// ----------------------------------------------------------------------
+static bool simCheck(SimChip &c, const std::string &name, const std::vector<Page> &pages, bool exit)
+{
+	c.runUntil(c.now() + (exit ? 1.0 : 12.0));
+	if (!c.appStarted()) {
+		fprintf(stderr, "%s: the app was not started\n", name.c_str());
+		return false;
+	}
+	for (const Page &p : pages) {
+		for (size_t i = 0; i < p.data.size(); i++) {
+			if (c.flash[p.addr + i] != p.data[i]) {
+				fprintf(stderr, "%s: simulated flash differs at 0x%04x\n", name.c_str(), (unsigned)(p.addr + i));
+				return false;
+			}
+		}
+	}
+	if (c.spmWhileBusy != 0 || c.rwwReadsWhileBusy != 0 || c.spmIntoBootSection != 0) {
+		fprintf(stderr, "%s: %u SPM while busy, %u reads of the disabled RWW section, %u SPM into the boot section\n",
+			name.c_str(), c.spmWhileBusy, c.rwwReadsWhileBusy, c.spmIntoBootSection);
+		return false;
+	}
+	if (c.appStartedEarly()) {
+		fprintf(stderr, "%s: the app was started with SPM busy or the RWW section disabled\n", name.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool simCheck(SimDevice &d, const std::vector<Page> &pages, bool exit)
+{
+	return simCheck(d.chip(), d.serial(), pages, exit);
+}
+
+// ----------------------------------------------------------------------
+// the app section as it is with the image in flash, 0xFF where it has nothing
+// ----------------------------------------------------------------------
+static std::vector<uint8_t> appSection(const Options &o, const char *path)
+{
+	std::vector<uint8_t> app(o.flashSize - o.bootSize, 0xFF);
+	Image image;
+
+	image.loadHex(path);
+	if (image.end() > app.size()) {
+		throw std::runtime_error(std::string(path) + ": reaches into the bootloader");
+	}
+	for (const Page &p : image.pages(o.pageSize)) {
+		std::copy(p.data.begin(), p.data.end(), app.begin() + p.addr);
+	}
+	return app;
+}
+
+// ----------------------------------------------------------------------
+// the app section of a simulated board before the upload, never blank, so a
+// page that should have been written but was not shows up
+// ----------------------------------------------------------------------
+static std::vector<uint8_t> simOldApp(const Options &o)
+{
+	if (o.oldImage != nullptr) {
+		return appSection(o, o.oldImage);
+	}
+	if (o.patchImage != nullptr) {
+		return o.patchFlash;
+	}
+	std::vector<uint8_t> app(SimChip::BOOT_START);
+	uint32_t x = 1;
+	for (uint8_t &b : app) {
+		x = x * 1103515245 + 12345;
+		b = x >> 16;
+	}
+	return app;
+}
+
+// ----------------------------------------------------------------------
+// powers up n simulated bootloaders and waits for them to enumerate
+// ----------------------------------------------------------------------
+static std::vector<SimDevice *> simAttach(SimBus &bus, unsigned n, const std::vector<uint8_t> &oldApp)
+{
+	std::vector<SimDevice *> devs;
+
+	for (unsigned i = 0; i < n; i++) {
+		devs.push_back(bus.add());
+		std::copy(oldApp.begin(), oldApp.end(), devs.back()->chip().flash.begin());
+	}
+	if (!bus.attach()) {
+		throw std::runtime_error("a simulated bootloader did not enumerate");
+	}
+	return devs;
+}
+
+static void report(const Flasher &f)
+{
+	if (!f.ok()) {
+		printf("%s: failed, %s\n", f.device().serial().c_str(), f.error().c_str());
+		return;
+	}
+	printf("%s: %zu bytes in %.2f s, %.1f KB/s", f.device().serial().c_str(), f.bytesWritten(),
+		f.seconds(), f.bytesWritten() / 1024.0 / f.seconds());
+	if (f.blankPagesSkipped() > 0) {
+		printf(", %u blank pages skipped", f.blankPagesSkipped());
+	}
+	if (f.pagesPatched() > 0 || f.pagesUnchanged() > 0) {
+		printf(", %u pages patched, %u unchanged", f.pagesPatched(), f.pagesUnchanged());
+	}
+	printf("\n");
+}
+
+// ----------------------------------------------------------------------
+// one line per device, and the time until the last one was done
+// ----------------------------------------------------------------------
+static int reportAll(const std::vector<std::unique_ptr<Flasher>> &flashers)
+{
+	double last = 0;
+	size_t bytes = 0;
+	unsigned failed = 0;
+
+	for (auto &f : flashers) {
+		report(*f);
+		if (f->ok()) {
+			last = std::max(last, f->seconds());
+			bytes += f->bytesWritten();
+		}
+		else {
+			failed++;
+		}
+	}
+	if (flashers.size() > 1) {
+		printf("%zu devices, %u failed, %.2f s, %.1f KB/s in total\n", flashers.size(), failed, last,
+			last > 0 ? bytes / 1024.0 / last : 0.0);
+	}
+	return failed == 0 ? 0 : 1;
+}
+
+static int simulate(const Options &o, const std::vector<Page> &pages)
+{
+	SimBus bus(o.timing);
+	std::vector<SimDevice *> devs = simAttach(bus, o.simDevices, simOldApp(o));
+	auto flashers = run(bus, pages, o.pageSize, o.flash, !o.quiet);
+	int status = reportAll(flashers);
+	for (SimDevice *d : devs) {
+		if (!simCheck(*d, pages, o.flash.exit)) {
+			status = 1;
+		}
+		else if (d->exitRequested() >= 0) {
+			printf("%s: app started %.0f us after POWERDOWN\n", d->serial().c_str(),
+				(d->chip().appStartTime() - d->exitRequested()) * 1e6);
+		}
+	}
+	return status;
+}
+
+static int scale(const Options &o, const std::vector<Page> &pages)
+{
+	int status = 0;
+
+	printf("devices  seconds  KB/s total  KB/s per device  result\n");
+	for (unsigned n = 1; n <= 32; n *= 2) {
+		SimBus bus(o.timing);
+		std::vector<SimDevice *> devs = simAttach(bus, n, simOldApp(o));
+		auto flashers = run(bus, pages, o.pageSize, o.flash, false);
+		double last = 0;
+		size_t bytes = 0;
+		bool ok = true;
+		for (size_t i = 0; i < n; i++) {
+			ok = ok && flashers[i]->ok() && simCheck(*devs[i], pages, o.flash.exit);
+			last = std::max(last, flashers[i]->seconds());
+			bytes += flashers[i]->bytesWritten();
+		}
+		printf("%7u  %7.2f  %10.1f  %15.1f  %s\n", n, last, bytes / 1024.0 / last, bytes / 1024.0 / last / n,
+			ok ? "ok" : "failed");
+		if (!ok) {
+			status = 1;
+		}
+	}
+	return status;
+}
+
+static int sweep(const Options &o, const std::vector<Page> &pages)
+{
+	int status = 0;
+
+	printf("depth  seconds   KB/s  pages  result\n");
+	for (unsigned depth = 1; depth <= 8; depth++) {
+		SimBus bus(o.timing);
+		SimDevice *d = simAttach(bus, 1, simOldApp(o))[0];
+		FlashOptions fo = o.flash;
+
+		fo.depth = depth;
+		auto flashers = run(bus, pages, o.pageSize, fo, false);
+		const Flasher &f = *flashers[0];
+		bool ok = f.ok() && simCheck(*d, pages, o.flash.exit);
+		printf("%5u  %7.2f  %5.1f  %5u  %s\n", depth, f.seconds(), f.bytesWritten() / 1024.0 / f.seconds(),
+			d->pagesProgrammed(), ok ? "ok" : f.error().c_str());
+		if (!ok) {
+			status = 1;
+		}
+	}
+	return status;
+}
+
+// ----------------------------------------------------------------------
+// the same upload to a board holding the -P image, once whole and once
+// as patches against it
+// ----------------------------------------------------------------------
+static int compare(const Options &o, const std::vector<Page> &pages)
+{
+	int status = 0;
+
+	printf("upload  seconds  bytes sent  pages programmed  result\n");
+	for (int patch = 0; patch < 2; patch++) {
+		SimBus bus(o.timing);
+		SimDevice *d = simAttach(bus, 1, simOldApp(o))[0];
+		FlashOptions fo = o.flash;
+
+		fo.oldFlash = patch ? &o.patchFlash : nullptr;
+		auto flashers = run(bus, pages, o.pageSize, fo, false);
+		const Flasher &f = *flashers[0];
+		bool ok = f.ok() && simCheck(*d, pages, fo.exit);
+		printf("%-6s  %7.2f  %10zu  %16u  %s\n", patch ? "patch" : "full", f.seconds(), f.bytesWritten(),
+			d->pagesProgrammed(), ok ? "ok" : f.error().c_str());
+		if (!ok) {
+			status = 1;
+		}
+	}
+	return status;
+}
+
+// ----------------------------------------------------------------------
+// a UART upload to a simulated board just reset by DTR, STK500v1 against
+// frame mode, for serial adapters from none to an FTDI's default latency
+// ----------------------------------------------------------------------
+static int uartSweep(const Options &o, const std::vector<Page> &pages)
+{
+	const double latencies[] = { 0, 1, 2, 4, 8, 16 };
+	SimChipTiming timing;
+	int status = 0;
+
+	timing.eraseMs = o.timing.eraseMs;
+	timing.writeMs = o.timing.writeMs;
+	printf("latency ms  STK500v1 s  frame mode s  frames resent  app start us  result\n");
+	for (double latency : latencies) {
+		double seconds[2];
+		double handoff = 0;		// from the last reply leaving TXD, the slower of the two
+		unsigned resent = 0;
+		bool ok = true;
+		for (int frame = 0; frame < 2; frame++) {
+			SimChip chip(0, 0, timing, 1 << 1);	// EXTRF
+			std::vector<uint8_t> oldApp = simOldApp(o);
+			std::copy(oldApp.begin(), oldApp.end(), chip.flash.begin());
+			SimSerialPort port(chip, o.baud, latency);
+			UartFlasher f(port, pages, frame);
+			if (!f.run()) {
+				fprintf(stderr, "%s: %s\n", frame ? "frame mode" : "STK500v1", f.error().c_str());
+			}
+			ok = ok && f.ok() && f.usedFrameMode() == (frame != 0)
+				&& simCheck(chip, frame ? "frame mode" : "STK500v1", pages, true);
+			seconds[frame] = f.seconds();
+			resent += f.framesResent();
+			handoff = std::max(handoff, chip.appStartTime() - port.lastTransmit());
+		}
+		printf("%10.0f  %10.2f  %12.2f  %13u  %12.0f  %s\n", latency, seconds[0], seconds[1], resent, handoff * 1e6,
+			ok ? "ok" : "failed");
+		if (!ok) {
+			status = 1;
+		}
+	}
+	return status;
+}
+
+static int flashUart(const Options &o, const std::vector<Page> &pages)
+{
+	TtyPort port(o.tty, o.baud);
+	UartFlasher f(port, pages, o.frameMode);
+
+	if (!f.run()) {
+		printf("%s: failed, %s\n", o.tty, f.error().c_str());
+		return 1;
+	}
+	printf("%s: %zu bytes in %.2f s, %.1f KB/s, %s", o.tty, f.bytesWritten(), f.seconds(),
+		f.bytesWritten() / 1024.0 / f.seconds(), f.usedFrameMode() ? "frame mode" : "STK500v1");
+	if (o.frameMode && !f.usedFrameMode()) {
+		printf(", the bootloader has no frame mode");
+	}
+	if (f.framesResent() > 0) {
+		printf(", %u frames resent", f.framesResent());
+	}
+	printf("\n");
+	return 0;
+}
+
+static int flashUsb(const Options &o, const std::vector<Page> &pages)
+{
+#ifdef NO_LIBUSB
+	(void)o;
+	(void)pages;
+	fprintf(stderr, "built without libusb, only the simulation and -U work\n");
+	return 1;
+#else
+	UsbBus bus;
+	bus.open(o.serials);
+	if (bus.devices().empty()) {
+		fprintf(stderr, "no bootloader found\n");
+		return 1;
+	}
+	if (!o.quiet) {
+		for (Device *d : bus.devices()) {
+			printf("%s: found\n", d->serial().c_str());
+		}
+	}
+	return reportAll(run(bus, pages, o.pageSize, o.flash, !o.quiet));
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	Options o;
+	int c;
+
+	o.flash.signature = { 0x1E, 0x95, 0x0F };
+	while ((c = getopt(argc, argv, "d:c:p:f:m:kP:VU:FB:nu:qsN:o:STCRe:w:l:b:t:")) != -1) {
+		switch (c) {
+		case 'd': o.flash.depth = atoi(optarg); break;
+		case 'c': o.flash.chunk = atoi(optarg); break;
+		case 'p': o.pageSize = atoi(optarg); break;
+		case 'f': o.flashSize = atoi(optarg); break;
+		case 'm': o.flash.signature = parseSignature(optarg); break;
+		case 'k': o.flash.skipBlank = true; break;
+		case 'P': o.patchImage = optarg; break;
+		case 'C': o.compare = true; break;
+		case 'V': o.flash.verify = true; break;
+		case 'U': o.tty = optarg; break;
+		case 'F': o.frameMode = true; break;
+		case 'B': o.baud = atoi(optarg); break;
+		case 'n': o.flash.exit = false; break;
+		case 'u': o.serials.push_back(optarg); break;
+		case 'q': o.quiet = true; break;
+		case 's': o.simulate = true; break;
+		case 'N': o.simDevices = atoi(optarg); break;
+		case 'o': o.oldImage = optarg; break;
+		case 'S': o.sweep = true; break;
+		case 'T': o.scale = true; break;
+		case 'R': o.uartSweep = true; break;
+		case 'e': o.timing.eraseMs = atof(optarg); break;
+		case 'w': o.timing.writeMs = atof(optarg); break;
+		case 'l': o.timing.hostLatencyMs = atof(optarg); break;
+		case 'b': o.timing.busPerFrame = atoi(optarg); break;
+		case 't': o.timing.devicePerFrame = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || o.pageSize == 0 || (o.pageSize & (o.pageSize - 1)) != 0
+		|| o.flashSize <= o.bootSize || o.timing.busPerFrame == 0 || o.timing.devicePerFrame == 0
+		|| o.simDevices == 0 || (o.compare && o.patchImage == nullptr) || o.baud == 0
+		|| (o.tty != nullptr && (o.patchImage != nullptr || o.flash.skipBlank || o.flash.verify))) {
+		usage();
+	}
+
+	Image image;
+	try {
+		image.loadHex(argv[optind]);
+		if (o.patchImage != nullptr) {
+			o.patchFlash = appSection(o, o.patchImage);
+		}
+	}
+	catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	if (image.end() > o.flashSize - o.bootSize) {
+		fprintf(stderr, "%s: image reaches into the bootloader at 0x%04x\n", argv[optind], o.flashSize - o.bootSize);
+		return 1;
+	}
+	std::vector<Page> pages = image.pages(o.pageSize);
+	unsigned blank = std::count_if(pages.begin(), pages.end(), [](const Page &p) { return p.blank; });
+	printf("%s: %zu bytes, %zu pages, %u of them blank\n", argv[optind], image.size(), pages.size(), blank);
+
+	if (o.patchImage != nullptr && !o.compare) {
+		o.flash.oldFlash = &o.patchFlash;
+	}
+	if ((o.simulate || o.sweep || o.scale || o.compare || o.uartSweep)
+		&& (o.pageSize != SimChip::PAGE_SIZE || o.flashSize != SimChip::FLASH_SIZE)) {
+		fprintf(stderr, "the simulated bootloader is the ATmega328P build, -p %u -f %u\n", SimChip::PAGE_SIZE,
+			SimChip::FLASH_SIZE);
+		return 1;
+	}
+	try {
+		if (o.compare) {
+			return compare(o, pages);
+		}
+		if (o.sweep) {
+			return sweep(o, pages);
+		}
+		if (o.scale) {
+			return scale(o, pages);
+		}
+		if (o.uartSweep) {
+			return uartSweep(o, pages);
+		}
+		if (o.simulate) {
+			return simulate(o, pages);
+		}
+		if (o.tty != nullptr) {
+			return flashUart(o, pages);
+		}
+		return flashUsb(o, pages);
+	}
+	catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+}
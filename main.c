@@ -45,9 +45,12 @@
 //#include <avr/fuse.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <avr/sleep.h>
+#include <util/crc16.h>
 //#include <util/delay.h>
 #include "pin_defs.h"
 #include "optiboot.h"
+#include "boot_mailbox.h"
 #include <usbconfig.h>
 #include <bootloaderconfig.h>
 #include <usbdrv/usbdrv.c>	// must be included, because of static function declarations are being used, which saves flash space
@@ -65,11 +68,115 @@
 #define ENABLE_CLEAN_EXIT // must be used with ENABLE_REQUEST_EXIT
 #define ENABLE_OPTIBOOT
 #define ENABLE_BLANK_CHECK
+//#define ENABLE_MAILBOX // the app can ask for the bootloader or a fast start, see boot_mailbox.h
+//#define ENABLE_MAILBOX_EEPROM // also honor the one-shot flag in EEPROM, survives a power cycle
+//#define ENABLE_BOOT_CONFIG // settings below can be overridden by a config block in EEPROM
+//#define ENABLE_HOST_DETECT // leave early when neither a USB host nor the UART shows any sign of life
+//#define ENABLE_BOOT_STATS // startup timing can be read back with USBTINY_BOOT_STATS
+//#define ENABLE_IDLE_SLEEP // sleep between interrupts in the main loop
+//#define ENABLE_PAGE_CRC // hosts can compare flash pages by CRC instead of reading them back
+//#define ENABLE_PATCHING // pages can be rebuilt from old flash plus literals, see USBTINY_PATCH_PAGE
+//#define ENABLE_JOURNAL // upload progress is kept in EEPROM so an interrupted upload can be resumed
+//#define ENABLE_VERIFY // every written page is read back, see USBTINY_VERIFY_STATUS
+
+// Timebase, every time below is given in ms and converted for the F_CPU being built.
+// Timer1 runs at clk/1024 for the waits before and after the main loop, and at clk/1
+// in the main loop, which counts its overflows.
+#define T1_SLOW_TICKS(ms)	(F_CPU / 1024 * (ms) / 1000)				// Timer1 ticks at clk/1024
+#define T1_OVF(ms)			((F_CPU / 1000 * (ms) + 32768) / 65536)	// Timer1 overflows at clk/1, rounded
+#define T1_OVF_PER_SEC		T1_OVF(1000)
 
 // timeout for the bootloader
 #define USBBOOTLOADER_TIMEOUT 10
 #define UARTBOOTLOADER_TIMEOUT 3
 
+// which resets run the bootloader, select with DEFINES=-DBOOT_POLICY=x in the Makefile
+#define BOOT_POLICY_ALWAYS		0	// every reset
+#define BOOT_POLICY_EXT_RESET	1	// only the reset button, power-on, brown-out and watchdog resets start the app at once
+#define BOOT_POLICY_DOUBLE_TAP	2	// only pressing the reset button twice within DOUBLE_TAP_WINDOW_MS
+#ifndef BOOT_POLICY
+#define BOOT_POLICY BOOT_POLICY_ALWAYS
+#endif
+#define DOUBLE_TAP_WINDOW_MS 500
+#define DOUBLE_TAP_MAGIC 0xB007
+
+// Time USB is held disconnected to force a re-enumeration when a host is attached. USB 2.0
+// hubs poll their status change endpoint every 256 ms, a shorter disconnect can go unseen.
+#define USB_DISCONNECT_MS 256
+#define USB_DISCONNECT_TICKS ((uint16_t)T1_SLOW_TICKS(USB_DISCONNECT_MS))
+
+// Time after connecting in which a USB host has to reset the bus, or the UART has to
+// receive something. The hub can take up to 256 ms to report the attach (see
+// USB_DISCONNECT_MS), the host then debounces for at least 100 ms (USB TATTDB) and resets
+// the bus for 10 ms or more, so this should not go much lower.
+#define HOST_DETECT_MS 500
+#define HOST_DETECT_OVF ((uint8_t)T1_OVF(HOST_DETECT_MS))
+
+// longest wait for the reply to USBTINY_POWERDOWN to go out
+#define CLEAN_EXIT_MS 256
+
+// LED while waiting without USB activity, a number of short blinks once per second,
+// boards running below 16 MHz (the 3V ones) blink twice, the others three times
+#define WAITING_LED_BLINK_MS 65
+#if (F_CPU < 16000000)
+#define WAITING_LED_BLINKS 2
+#else
+#define WAITING_LED_BLINKS 3
+#endif
+
+#if T1_SLOW_TICKS(USB_DISCONNECT_MS) > 0xFFFF || T1_SLOW_TICKS(CLEAN_EXIT_MS) > 0xFFFF || T1_SLOW_TICKS(DOUBLE_TAP_WINDOW_MS) > 0xFFFF
+#error "a wait does not fit Timer1 at clk/1024 with this F_CPU"
+#endif
+#if T1_OVF(HOST_DETECT_MS) > 0xFF || T1_OVF(HOST_DETECT_MS) < 1
+#error "HOST_DETECT_MS does not fit the Timer1 overflow counter with this F_CPU"
+#endif
+#if T1_OVF(WAITING_LED_BLINK_MS) < 2 || T1_OVF(WAITING_LED_BLINK_MS) * WAITING_LED_BLINKS * 2 >= T1_OVF_PER_SEC
+#error "the LED blinks do not fit into one second with this F_CPU"
+#endif
+
+// Runtime settings, defaulting to the constants above. With ENABLE_BOOT_CONFIG
+// they are read once at startup from the block just below the last two EEPROM bytes
+// (which are left to the mailbox flag), if its version and checksum are right.
+// USBTINY_CONFIG_WRITE writes a new block, it takes effect on the next reset.
+typedef struct bootConfig { // must fit into buffer[8]
+	uint8_t		version;			// BOOT_CONFIG_VERSION
+	uint8_t		usbTimeout;			// seconds, once USB has been used
+	uint8_t		uartTimeout;		// seconds, without USB activity
+	uint16_t	disconnectTicks;	// USB re-enumeration disconnect, Timer1 ticks at clk/1024
+	uint8_t		flags;				// BOOT_CONFIG_NO_USB, BOOT_CONFIG_NO_UART
+	uint8_t		bootPolicy;			// one of BOOT_POLICY_x
+	uint8_t		checksum;			// makes the sum of all bytes 0
+} bootConfig_t;
+
+#define BOOT_CONFIG_VERSION		1
+#define BOOT_CONFIG_NO_USB		(1 << 0)	// do not start USB at all
+#define BOOT_CONFIG_NO_UART		(1 << 1)	// do not listen on the UART, both together are refused
+#define BOOT_CONFIG_ADDR		((void *)((uint8_t *)BOOT_MAILBOX_EEPROM - sizeof(bootConfig_t)))
+
+// Upload progress, kept in EEPROM below the config block. A host opens a session with
+// USBTINY_JOURNAL_BEGIN, every committed page is recorded, USBTINY_POWERDOWN (or the end of
+// a UART upload) closes it. An open session keeps the app from being started, so a half
+// written image never runs, and reopening it with the same ID and hash resumes after lastPage.
+// The lastPage word is rewritten for each page, mind the EEPROM endurance on a busy line.
+// The checksum leaves lastPage out so that it can be rewritten on its own, a block with a
+// wrong magic or checksum (the app's data, or a session cut short while closing) is closed.
+typedef struct bootJournal {
+	uint16_t	session;			// host chosen ID, JOURNAL_NONE when closed
+	uint16_t	imageHash;			// host's hash of the image being written
+	uint16_t	lastPage;			// highest page committed in this session, JOURNAL_NONE for none
+	uint8_t		magic;				// BOOT_JOURNAL_MAGIC
+	uint8_t		checksum;			// makes the sum of all bytes but lastPage 0
+} bootJournal_t;
+
+#define BOOT_JOURNAL_MAGIC		0x4A		// 'J'
+#define JOURNAL_NONE			0xFFFF		// also what erased EEPROM reads
+#ifdef ENABLE_JOURNAL
+#define IMAGE_INCOMPLETE()		(journal.session != JOURNAL_NONE)
+#else
+#define IMAGE_INCOMPLETE()		0
+#endif
+#define BOOT_JOURNAL_ADDR		((bootJournal_t *)((uint8_t *)BOOT_CONFIG_ADDR - sizeof(bootJournal_t)))
+
 enum
 {
 	// Generic requests
@@ -88,9 +195,41 @@ enum
 	USBTINY_EEPROM_READ,	// read eeprom (wIndex:address)
 	USBTINY_EEPROM_WRITE,	// write eeprom (wIndex:address, wValue:timeout)
 	USBTINY_DDRWRITE,		// set port direction
-	USBTINY_SPI1			// a single SPI command
+	USBTINY_SPI1,			// a single SPI command
+	// Bootloader specific requests, numbered apart from the USBtinyISP ones
+	USBTINY_EXT_ADDR = 0x40,	// set flash address bits 16..31 for the next flash read/write (wIndex:high address)
+	USBTINY_CONFIG_WRITE,	// write the EEPROM config block, only if it is valid (wIndex:0, data:bootConfig_t)
+	USBTINY_BOOT_STATS,		// read the startup timing (returns bootStats_t)
+	USBTINY_PAGE_CRC,		// CRC16 of each flash page, low byte first (wIndex:page address, wLength:2 per page)
+	USBTINY_PATCH_PAGE,		// rebuild a flash page from patch ops (wIndex:page address, data:ops)
+	USBTINY_JOURNAL_BEGIN,	// open or resume an upload session (wValue:session, wIndex:image hash)
+	USBTINY_JOURNAL_READ,	// read the upload progress (returns bootJournal_t)
+	USBTINY_VERIFY_STATUS	// read the result of reading back the written pages (returns verifyStatus_t)
 };
 
+#ifdef ENABLE_VERIFY
+#define VERIFY_MAX_LISTED 8
+typedef struct verifyStatus {
+	uint16_t	pages;							// pages written and read back since the bootloader started
+	uint8_t		failed;							// pages that did not read back right, up to 255
+	uint16_t	failedPage[VERIFY_MAX_LISTED];	// page numbers of the first of them
+} verifyStatus_t;
+#endif
+
+// USBTINY_PATCH_PAGE ops, they must produce exactly one page or nothing is written
+#define PATCH_LITERAL(n)	((n) - 1)			// followed by n (1..128) bytes of new data
+#define PATCH_COPY(n)		(0x80 | ((n) - 1))	// followed by a 16-bit source byte address, copies n (1..128) bytes of old flash
+
+#ifdef ENABLE_BOOT_STATS
+typedef struct bootStats {
+	uint8_t		lineState;			// USBIN & USBMASK before connecting
+	uint16_t	disconnectTicks;	// how long the disconnect was held, Timer1 ticks at clk/1024
+	uint16_t	resetOvf;			// Timer1 overflows at clk/1 from connecting to the first bus reset, 0 if none yet
+	uint16_t	enumOvf;			// same, up to the host selecting a configuration
+	uint8_t		maxPollOvf;			// most Timer1 overflows seen between two usbPoll() calls
+} bootStats_t;
+#endif
+
 #if (FLASHEND) > 0xFFFF		// need long addressing for large flash
 #	define CUR_ADDR			cur_addr.addr
 #	define addr_t			uint32_t
@@ -109,38 +248,536 @@ typedef union longConverter { // utility for manipulating address pointer with p
 static	uint8_t				req_boot_exit;
 #endif
 static	longConverter_t		cur_addr;
-static	uchar				dirty = 0;			// if flash needs to be written
+#if (FLASHEND) > 0xFFFF
+static	uint16_t			ext_addr;			// high word of the flash address, see USBTINY_EXT_ADDR
+#endif
+static	uchar				dirty = 0;			// if the page cache holds data to be written
+static	addr_t				cachePage;			// flash address of the cached page
+static	uint8_t				pageData[SPM_PAGESIZE];	// page cache, written to flash in one go by finalize_flash_if_dirty()
+static	uint8_t				pageValid[SPM_PAGESIZE / 8];	// one bit per byte of pageData that holds data
 static	uchar				cmd0;				// current read/write command byte
 static	uint8_t				remaining;			// bytes remaining in current transaction
+#ifdef ENABLE_JOURNAL
+static	bootJournal_t		journal;			// RAM copy of the EEPROM journal
+#endif
+#ifdef ENABLE_VERIFY
+static	verifyStatus_t		verify;
+#endif
+#ifdef ENABLE_PATCHING
+static	uint8_t				patchState;			// what the next patch byte is, one of PATCH_STATE_x
+static	uint8_t				patchCount;			// bytes left in the current patch op
+static	uint8_t				patchLow;			// low byte of the next page buffer word
+static	uint16_t			patchPos;			// bytes of the new page filled so far
+static	addr_t				patchSrc;			// copy source
+#define PATCH_STATE_OP		0
+#define PATCH_STATE_LITERAL	1
+#define PATCH_STATE_SRC_LO	2
+#define PATCH_STATE_SRC_HI	3
+#endif
+#ifdef ENABLE_PAGE_CRC
+static	uint16_t			pageCrc;			// CRC of the page at CUR_ADDR while its high byte is pending
+static	uchar				crcHigh;			// next USBTINY_PAGE_CRC byte is the high byte
+#endif
 static	uchar				buffer[8];			// talk via setup
-static	uint8_t				timeout = 0;		// timeout counter for USB comm
+static volatile	uint8_t		timeout = 0;		// timeout counter for USB comm, counted up by the Timer1 interrupt
 volatile	char			usbHasRxed = 0;		// whether or not USB comm is active
+volatile	char			usbHadReset = 0;	// whether a host has reset the bus, see USB_RESET_HOOK
 #ifdef ENABLE_BLANK_CHECK
 static uchar				isBlank;			// only allow exit if chip isn't blank
 #endif
+#ifdef ENABLE_BOOT_STATS
+static bootStats_t			stats;
+static volatile uint8_t		pollAge;			// Timer1 overflows since the last usbPoll()
+#endif
+#ifdef ENABLE_HOST_DETECT
+static volatile uint8_t		hostWait;			// Timer1 overflows left to see a host, see HOST_DETECT_MS
+#endif
+
+static uint16_t				doubleTapMagic __attribute__ ((section (".noinit"))); // survives the reset button
+static uint8_t				resetCause;			// MCUSR as found at startup
+static bootConfig_t			config = {
+	BOOT_CONFIG_VERSION, USBBOOTLOADER_TIMEOUT, UARTBOOTLOADER_TIMEOUT,
+	USB_DISCONNECT_TICKS, 0, BOOT_POLICY, 0
+};
+
+#ifdef ENABLE_MAILBOX
+static uint16_t				mailbox __attribute__ ((section (".noinit")));
+
+// runs before main(), calling main() pushes the return address over BOOT_MAILBOX
+void mailbox_fetch(void) __attribute__ ((naked, used, section (".init3")));
+void mailbox_fetch(void)
+{
+	mailbox = BOOT_MAILBOX;
+	BOOT_MAILBOX = 0;
+}
+#endif
+
+// ----------------------------------------------------------------------
+// jumps to the app at the start of flash, with the reset cause in r2 like
+// upstream optiboot, since MCUSR may have been cleared, see boot_mailbox.h
+// ----------------------------------------------------------------------
+#ifndef APP_START_JUMP	// the host build of the firmware (host/fw/) replaces it
+#define APP_START_JUMP(cause) __asm__ __volatile__ ( \
+		"mov r2, %0\n\t" \
+		"clr r30\n\t" \
+		"clr r31\n\t" \
+		"ijmp\n\t" \
+		:: "r" (cause) \
+	)
+#endif
+
+static void app_start(void) __attribute__ ((noreturn));
+static void app_start(void)
+{
+	APP_START_JUMP(resetCause);
+	__builtin_unreachable();
+}
+
+#if USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER & USB_PROP_IS_RAM
+int usbDescriptorStringSerialNumber[1 + USB_CFG_SERIAL_NUMBER_DIGITS];
+
+// ----------------------------------------------------------------------
+// fills the serial number string descriptor from the signature row
+// ----------------------------------------------------------------------
+static void build_serial_number(void)
+{
+	uint8_t i;
+
+	usbDescriptorStringSerialNumber[0] = USB_STRING_DESCRIPTOR_HEADER(USB_CFG_SERIAL_NUMBER_DIGITS);
+	for (i = 0; i < USB_CFG_SERIAL_NUMBER_DIGITS; i++)
+	{
+		uint8_t b = boot_signature_byte_get(USB_CFG_SERIAL_NUMBER_SIG_ADDR + i / 2);
+		b = (i & 1) ? (b & 0x0F) : (b >> 4);
+		usbDescriptorStringSerialNumber[1 + i] = b < 10 ? '0' + b : 'A' - 10 + b;
+	}
+}
+#endif
+
+#ifdef ENABLE_VERIFY
+// ----------------------------------------------------------------------
+// compares a just written page with the valid bytes of pageData
+// ----------------------------------------------------------------------
+static void verify_page(addr_t page)
+{
+	uint16_t i;
+
+	for (i = 0; i < SPM_PAGESIZE; i++) {
+		#if (FLASHEND) > 0xFFFF
+		if ((pageValid[i / 8] & (1 << (i & 7))) != 0 && pgm_read_byte_far(page + i) != pageData[i]) {
+		#else
+		if ((pageValid[i / 8] & (1 << (i & 7))) != 0 && pgm_read_byte((void *)(page + i)) != pageData[i]) {
+		#endif
+			break;
+		}
+	}
+	verify.pages++;
+	if (i < SPM_PAGESIZE)
+	{
+		if (verify.failed < VERIFY_MAX_LISTED) {
+			verify.failedPage[verify.failed] = page / SPM_PAGESIZE;
+		}
+		if (verify.failed != 0xFF) {
+			verify.failed++;
+		}
+	}
+}
+#endif
 
-void (*app_start)(void) = 0x0000; // function at start of flash memory, call to exit bootloader
+#ifdef ENABLE_JOURNAL
+// ----------------------------------------------------------------------
+// sum of the journal bytes covered by its checksum
+// ----------------------------------------------------------------------
+static uint8_t journal_sum(void)
+{
+	return (uint8_t)journal.session + (uint8_t)(journal.session >> 8)
+		+ (uint8_t)journal.imageHash + (uint8_t)(journal.imageHash >> 8)
+		+ journal.magic + journal.checksum;
+}
 
 // ----------------------------------------------------------------------
-// finishes a write operation if already started
+// records a committed page in an open session
+// ----------------------------------------------------------------------
+static void journal_commit(uint16_t page)
+{
+	if (journal.session != JOURNAL_NONE && (journal.lastPage == JOURNAL_NONE || page > journal.lastPage))
+	{
+		journal.lastPage = page;
+		eeprom_update_word(&BOOT_JOURNAL_ADDR->lastPage, page);
+	}
+}
+
+// ----------------------------------------------------------------------
+// ends the session, the image is complete
+// ----------------------------------------------------------------------
+static void journal_close()
+{
+	if (journal.session != JOURNAL_NONE)
+	{
+		// also breaks the checksum, either way the session reads as closed
+		journal.session = JOURNAL_NONE;
+		eeprom_update_word(&BOOT_JOURNAL_ADDR->session, JOURNAL_NONE);
+		#ifdef ENABLE_BLANK_CHECK
+		isBlank = pgm_read_word(0) == 0xFFFF;
+		#endif
+	}
+}
+#endif
+
+// ----------------------------------------------------------------------
+// writes the page cache to flash, once per page: called when a write moves
+// on to another page, before anything else touches flash and before exiting
 // ----------------------------------------------------------------------
 static void finalize_flash_if_dirty()
 {
 	if (dirty != 0)
 	{
 		#ifdef ENABLE_FLASH_WRITING
+		uint16_t i;
+
+		// bytes that were not written keep their old contents, so a few bytes can be
+		// changed anywhere with a single erase and write
+		for (i = 0; i < SPM_PAGESIZE; i++)
+		{
+			if ((pageValid[i / 8] & (1 << (i & 7))) == 0) {
+				#if (FLASHEND) > 0xFFFF
+				pageData[i] = pgm_read_byte_far(cachePage + i);
+				#else
+				pageData[i] = pgm_read_byte((void *)(cachePage + i));
+				#endif
+				pageValid[i / 8] |= 1 << (i & 7);
+			}
+		}
+
+		cli();
+		boot_page_erase(cachePage);
+		sei();
+		boot_spm_busy_wait();
+		for (i = 0; i < SPM_PAGESIZE; i += 2)
+		{
+			cli();
+			boot_page_fill(cachePage + i, pageData[i] | (pageData[i + 1] << 8));
+			sei();
+		}
 		cli();
-		boot_page_write(CUR_ADDR - 2);
+		boot_page_write(cachePage);
 		sei();
 		boot_spm_busy_wait();
 		cli();
 		boot_rww_enable();
 		sei();
+		#ifdef ENABLE_VERIFY
+		verify_page(cachePage);
+		#endif
+		#ifdef ENABLE_JOURNAL
+		journal_commit(cachePage / SPM_PAGESIZE);
+		#endif
 		#endif
 		dirty = 0;
 	}
 }
 
+#ifdef ENABLE_PAGE_CRC
+// ----------------------------------------------------------------------
+// CRC16 of a flash page, computed like usbCrc16() so hosts can reuse their USB CRC
+// ----------------------------------------------------------------------
+static uint16_t flash_page_crc(addr_t addr)
+{
+	uint16_t crc = 0xFFFF;
+	uint16_t i;
+
+	for (i = 0; i < SPM_PAGESIZE; i++, addr++) {
+		#if (FLASHEND) > 0xFFFF
+		crc = _crc16_update(crc, pgm_read_byte_far(addr));
+		#else
+		crc = _crc16_update(crc, pgm_read_byte((void *)addr));
+		#endif
+	}
+	return ~crc;
+}
+#endif
+
+#ifdef ENABLE_PATCHING
+// ----------------------------------------------------------------------
+// adds a byte of the new page to the page buffer
+// ----------------------------------------------------------------------
+static void patch_put(uint8_t b)
+{
+	if (patchPos >= SPM_PAGESIZE) {
+		// too long, still counted so patch_commit() drops it
+	}
+	else if ((patchPos & 1) != 0) {
+		cli();
+		boot_page_fill(CUR_ADDR + patchPos - 1, patchLow | (b << 8));
+		sei();
+	}
+	else {
+		patchLow = b;
+	}
+	#ifdef ENABLE_VERIFY
+	if (patchPos < SPM_PAGESIZE) {
+		pageData[patchPos] = b;
+	}
+	#endif
+	patchPos++;
+}
+
+// ----------------------------------------------------------------------
+// handles one byte of the USBTINY_PATCH_PAGE op stream
+// ----------------------------------------------------------------------
+static void patch_op(uint8_t b)
+{
+	if (patchState == PATCH_STATE_OP) {
+		patchCount = (b & 0x7F) + 1;
+		patchState = (b & 0x80) ? PATCH_STATE_SRC_LO : PATCH_STATE_LITERAL;
+	}
+	else if (patchState == PATCH_STATE_LITERAL) {
+		patch_put(b);
+		if (--patchCount == 0) {
+			patchState = PATCH_STATE_OP;
+		}
+	}
+	else if (patchState == PATCH_STATE_SRC_LO) {
+		patchSrc = b;
+		patchState = PATCH_STATE_SRC_HI;
+	}
+	else {
+		patchSrc |= (uint16_t)b << 8;
+		#if (FLASHEND) > 0xFFFF
+		patchSrc |= (addr_t)ext_addr << 16;
+		#endif
+		// the old flash is still intact, the page is only erased in patch_commit()
+		do {
+			#if (FLASHEND) > 0xFFFF
+			patch_put(pgm_read_byte_far(patchSrc++));
+			#else
+			patch_put(pgm_read_byte((void *)patchSrc++));
+			#endif
+		} while (--patchCount != 0);
+		patchState = PATCH_STATE_OP;
+	}
+}
+
+// ----------------------------------------------------------------------
+// programs the rebuilt page if the ops filled it exactly
+// ----------------------------------------------------------------------
+static void patch_commit(void)
+{
+	#ifdef ENABLE_VERIFY
+	uint8_t i;
+	#endif
+
+	if (patchPos == SPM_PAGESIZE && patchState == PATCH_STATE_OP)
+	{
+		// the page buffer survives the erase, so the page could be its own copy source
+		cli();
+		boot_page_erase(CUR_ADDR);
+		sei();
+		boot_spm_busy_wait();
+		cli();
+		boot_page_write(CUR_ADDR);
+		sei();
+		boot_spm_busy_wait();
+		cli();
+		boot_rww_enable();
+		sei();
+		#ifdef ENABLE_VERIFY
+		for (i = 0; i < sizeof(pageValid); i++) {
+			pageValid[i] = 0xFF;
+		}
+		verify_page(CUR_ADDR);
+		#endif
+		#ifdef ENABLE_JOURNAL
+		journal_commit(CUR_ADDR / SPM_PAGESIZE);
+		#endif
+		#ifdef ENABLE_BLANK_CHECK
+		isBlank = IMAGE_INCOMPLETE();
+		#endif
+	}
+	else
+	{
+		// drops the page buffer of a rejected patch
+		cli();
+		boot_rww_enable();
+		sei();
+	}
+}
+#endif
+
+#ifdef ENABLE_BOOT_CONFIG
+// ----------------------------------------------------------------------
+// checks version, checksum and that at least one transport stays enabled
+// ----------------------------------------------------------------------
+static uchar boot_config_valid(bootConfig_t *c)
+{
+	uchar i, sum = 0;
+
+	for (i = 0; i < sizeof(bootConfig_t); i++) {
+		sum += ((uchar *)c)[i];
+	}
+	return sum == 0 && c->version == BOOT_CONFIG_VERSION
+		&& (c->flags & (BOOT_CONFIG_NO_USB | BOOT_CONFIG_NO_UART)) != (BOOT_CONFIG_NO_USB | BOOT_CONFIG_NO_UART);
+}
+#endif
+
+// ----------------------------------------------------------------------
+// cleanup! returns everything the bootloader touched to its reset state
+// and jumps straight to the app, also used by optiboot
+// ----------------------------------------------------------------------
+void leave_bootloader(void)
+{
+	#ifdef ENABLE_OPTIBOOT
+	optiboot_finish(); // a frame mode page may still be programmed in the background
+	#endif
+	finalize_flash_if_dirty(); // the last page may still be cached
+
+	cli();// disable interrupts
+
+	// the app runs from the RWW section, which reads as 0xFF until the last
+	// page erase or write is done and it is enabled again
+	boot_spm_busy_wait();
+	boot_rww_enable();
+
+	// turn off and return port to normal
+	LED_PORT &= ~_BV(LED);
+	LED_DDR  &= ~_BV(LED);
+
+	// reset timer
+	TCCR1B = 0;
+	TIMSK1 = 0;
+	TCNT1 = 0;
+	OCR1A = 0;
+	TIFR1 = _BV(TOV1) | _BV(OCF1A);
+
+	// deinitialize USB
+	USB_INTR_ENABLE = 0;
+	USB_INTR_CFG = 0;
+	USB_INTR_PENDING = 1 << USB_INTR_PENDING_BIT;
+
+	#ifdef ENABLE_OPTIBOOT
+	optiboot_deinit();
+	#endif
+
+	// move interrupt back
+	MCUCR = (1 << IVCE);	// enable change of interrupt vectors
+	MCUCR = (0 << IVSEL);	// move interrupts to app flash section
+
+	app_start(); // jump to user app
+}
+
+// ----------------------------------------------------------------------
+// Timer1 runs at clk/1 while the main loop waits, the overflow keeps time
+// and drives the LED, the compare match ends the LED pulse while fading.
+// Both re-enable interrupts first so the USB interrupt is never held up.
+// ----------------------------------------------------------------------
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK)
+{
+	static uint16_t t1ovf = 0; // Timer1 overflows in the current second
+	static uint16_t duty = 0;
+	static char dutyDir = 0;
+	#ifdef ENABLE_BOOT_STATS
+	static uint16_t upOvf = 0;
+	#endif
+
+	if (usbHasRxed != 0)
+	{
+		LED_PORT |= _BV(LED);
+		if (duty == 0) {
+			dutyDir = dutyDir ? 0 : 1;
+		}
+
+		#define WAITING_LED_FADE_RATE 512 // must be power of 2
+		if (dutyDir == 0) {
+			duty -= WAITING_LED_FADE_RATE;
+		}
+		else {
+			duty += WAITING_LED_FADE_RATE;
+		}
+		OCR1A = duty;
+		TIMSK1 = _BV(TOIE1) | _BV(OCIE1A);
+	}
+
+	t1ovf++;
+	#ifdef ENABLE_BOOT_STATS
+	upOvf++;
+	if (stats.resetOvf == 0 && usbHadReset != 0) {
+		stats.resetOvf = upOvf;
+	}
+	if (stats.enumOvf == 0 && usbConfiguration != 0) {
+		stats.enumOvf = upOvf;
+	}
+	if (pollAge != 0xFF) {
+		pollAge++;
+	}
+	if (pollAge > stats.maxPollOvf) {
+		stats.maxPollOvf = pollAge;
+	}
+	#endif
+	#ifdef ENABLE_HOST_DETECT
+	if (hostWait != 0) {
+		hostWait--;
+	}
+	#endif
+
+	#if USB_COUNT_SOF
+	// an attached host sends a SOF (keep-alive) every 1 ms, an exact clock, Timer1
+	// only keeps the time while there are none
+	static uint8_t lastSof = 0;
+	static uint16_t sofMs = 0;
+	uint8_t sofs = usbSofCount - lastSof;
+	lastSof += sofs;
+	sofMs += sofs;
+	if (sofMs >= 1000) {
+		sofMs -= 1000;
+		timeout++;
+	}
+	#endif
+
+	if (t1ovf >= T1_OVF_PER_SEC) {
+		t1ovf = 0;
+		#if USB_COUNT_SOF
+		if (sofs == 0)
+		#endif
+		timeout++;
+	}
+
+	if (usbHasRxed == 0)
+	{
+		// on during the even periods of WAITING_LED_BLINK_MS at the start of each second
+		uint16_t period = t1ovf / T1_OVF(WAITING_LED_BLINK_MS);
+		if (period < WAITING_LED_BLINKS * 2 && (period & 1) == 0) {
+			LED_PORT |= _BV(LED);
+		}
+		else {
+			LED_PORT &= ~_BV(LED);
+		}
+	}
+}
+
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
+{
+	// fade the LED
+	LED_PORT &= ~_BV(LED);
+}
+
+// ----------------------------------------------------------------------
+// looks at D+/D- before USB is started, returns how long to fake a disconnect
+// ----------------------------------------------------------------------
+static uint16_t usb_disconnect_ticks(void)
+{
+	// an attached host pulls both lines down with 15k, the 1.5k pullup holds D- up (J state)
+	uint8_t lines = USBIN & USBMASK;
+	#ifdef ENABLE_BOOT_STATS
+	stats.lineState = lines;
+	#endif
+	if (lines == 0) {
+		// SE0, the host is already resetting the bus and will enumerate us anyway,
+		// D- low alone with D+ high is a K state (resume), not a reset
+		return 0;
+	}
+	// whether a host is attached can not be told reliably from D+, so always disconnect
+	return config.disconnectTicks;
+}
+
 #ifdef ENABLE_CHIP_ERASE
 // ----------------------------------------------------------------------
 // chip erase
@@ -211,15 +848,19 @@ uchar	usbFunctionSetup ( uchar data[8] )
 	else if ( req == USBTINY_POWERDOWN )
 	{
 		finalize_flash_if_dirty();
+		#ifdef ENABLE_JOURNAL
+		journal_close();
+		#endif
 		#ifdef ENABLE_REQUEST_EXIT
 		req_boot_exit = 1;
+		#ifdef ENABLE_CLEAN_EXIT
+		usbCurrentTok = 0; // the status OUT may have been NAKed already, see the clean exit in main()
+		#endif
 		#endif
 		return 0;
 	}
 	else if ( req == USBTINY_SPI )
 	{
-		finalize_flash_if_dirty(); // partial page writes are not fully written unless this is called here, it must be HERE
-
 		usbMsgPtr = (usbMsgPtr_t)buffer;
 
 		// this tricks "usbtiny_cmd" into succeeding
@@ -279,19 +920,93 @@ uchar	usbFunctionSetup ( uchar data[8] )
 	else if ( req == USBTINY_SPI1 )
 	{
 		// I don't know what this is used for, there are no single SPI transactions in the ISP protocol
-		finalize_flash_if_dirty();
 		return 1;
 	}
 	else if ( req == USBTINY_POLL_BYTES )
+	{
+		return 0;
+	}
+	#ifdef ENABLE_JOURNAL
+	else if ( req == USBTINY_JOURNAL_BEGIN )
+	{
+		finalize_flash_if_dirty();
+		// the same session and image carry on after lastPage, anything else starts over
+		if (journal.session != rq->wValue.word || journal.imageHash != rq->wIndex.word)
+		{
+			journal.session = rq->wValue.word;
+			journal.imageHash = rq->wIndex.word;
+			journal.lastPage = JOURNAL_NONE;
+			journal.magic = BOOT_JOURNAL_MAGIC;
+			journal.checksum = 0;
+			journal.checksum = -journal_sum();
+			eeprom_update_block(&journal, BOOT_JOURNAL_ADDR, sizeof(bootJournal_t));
+		}
+		#ifdef ENABLE_BLANK_CHECK
+		isBlank = IMAGE_INCOMPLETE();
+		#endif
+		return 0;
+	}
+	else if ( req == USBTINY_JOURNAL_READ )
+	{
+		usbMsgPtr = (usbMsgPtr_t)&journal;
+		return 3 * sizeof(uint16_t);	// session, imageHash, lastPage
+	}
+	#endif
+	#ifdef ENABLE_VERIFY
+	else if ( req == USBTINY_VERIFY_STATUS )
 	{
 		finalize_flash_if_dirty();
+		usbMsgPtr = (usbMsgPtr_t)&verify;
+		return sizeof(verify);
+	}
+	#endif
+	#ifdef ENABLE_BOOT_STATS
+	else if ( req == USBTINY_BOOT_STATS )
+	{
+		usbMsgPtr = (usbMsgPtr_t)&stats;
+		return sizeof(stats);
+	}
+	#endif
+	#if (FLASHEND) > 0xFFFF
+	else if ( req == USBTINY_EXT_ADDR )
+	{
+		finalize_flash_if_dirty();
+		ext_addr = rq->wIndex.word;
 		return 0;
 	}
-	CUR_ADDR = *((uint16_t*)(&data[4]));
+	cur_addr.u16[1] = ext_addr;
+	#endif
+	cur_addr.u16[0] = rq->wIndex.word;
 	remaining = rq->wLength.bytes[0];
-	if ( req >= USBTINY_FLASH_READ && req <= USBTINY_EEPROM_WRITE )
+	if ( ( req >= USBTINY_FLASH_READ && req <= USBTINY_EEPROM_WRITE )
+	#ifdef ENABLE_BOOT_CONFIG
+	  || req == USBTINY_CONFIG_WRITE
+	#endif
+	#ifdef ENABLE_PAGE_CRC
+	  || req == USBTINY_PAGE_CRC
+	#endif
+	#ifdef ENABLE_PATCHING
+	  || req == USBTINY_PATCH_PAGE
+	#endif
+	   )
 	{
+		#ifdef ENABLE_PATCHING
+		if ( req == USBTINY_PATCH_PAGE && ( cur_addr.u16[0] & ( SPM_PAGESIZE - 1 ) ) != 0 ) {
+			return 0;	// patches replace whole pages
+		}
+		if ( cmd0 == USBTINY_PATCH_PAGE ) {
+			// a patch that never got its last packet leaves the page buffer partly filled
+			cli();
+			boot_rww_enable();
+			sei();
+		}
+		patchState = PATCH_STATE_OP;
+		patchPos = 0;
+		#endif
 		cmd0 = req;
+		#ifdef ENABLE_PAGE_CRC
+		crcHigh = 0;
+		#endif
 		if ( cmd0 != USBTINY_FLASH_WRITE ) {
 			finalize_flash_if_dirty();
 		}
@@ -317,6 +1032,21 @@ uchar	usbFunctionRead ( uchar* data, uchar len )
 
 	for	( i = 0; i < len; i++ )
 	{
+		#ifdef ENABLE_PAGE_CRC
+		if (cmd0 == USBTINY_PAGE_CRC) {
+			// two bytes per page, the CRC is computed for the low byte
+			if (crcHigh == 0) {
+				pageCrc = flash_page_crc(CUR_ADDR);
+				*data++ = pageCrc & 0xFF;
+			}
+			else {
+				*data++ = pageCrc >> 8;
+				CUR_ADDR += SPM_PAGESIZE;
+			}
+			crcHigh ^= 1;
+			continue;
+		}
+		#endif
 		if (cmd0 == USBTINY_EEPROM_READ) {
 			#ifdef ENABLE_EEPROM_READING
 			*data = eeprom_read_byte((void *)cur_addr.u16[0]);
@@ -324,8 +1054,12 @@ uchar	usbFunctionRead ( uchar* data, uchar len )
 		}
 		else if (cmd0 == USBTINY_FLASH_READ) {
 			#ifdef ENABLE_FLASH_READING
+			#if (FLASHEND) > 0xFFFF
+			*data = pgm_read_byte_far(CUR_ADDR);
+			#else
 			*data = pgm_read_byte((void *)CUR_ADDR);
 			#endif
+			#endif
 		}
 		data++;
 		CUR_ADDR++;
@@ -357,35 +1091,60 @@ uchar	usbFunctionWrite ( uchar* data, uchar len )
 	else if (cmd0 == USBTINY_FLASH_WRITE)
 	{
 		#ifdef ENABLE_FLASH_WRITING
-		for ( i = 0; i < len; )
+		for ( i = 0; i < len; i++ )
 		{
-			if ((cur_addr.u16[0] & (SPM_PAGESIZE - 1)) == 0) {
-				// page start, erase
-				cli();
-				boot_page_erase(CUR_ADDR);
-				sei();
-				boot_spm_busy_wait();
-			}
+			uint8_t offset = CUR_ADDR & (SPM_PAGESIZE - 1);
+			addr_t page = CUR_ADDR - offset;
 
-			dirty = 1;
-			cli();
-			boot_page_fill(CUR_ADDR, *(short *)data);
-			sei();
-
-			CUR_ADDR += 2;
-			data += 2;
-			i += 2;
-
-			if ((cur_addr.u16[0] & (SPM_PAGESIZE - 1)) == 0) {
-				// end of page
+			if (dirty != 0 && page != cachePage) {
+				// moved on to another page, the cached one is done
 				finalize_flash_if_dirty();
 			}
+			if (dirty == 0) {
+				uint8_t j;
+				for (j = 0; j < sizeof(pageValid); j++) {
+					pageValid[j] = 0;
+				}
+				cachePage = page;
+				dirty = 1;
+			}
+
+			pageData[offset] = *data++;
+			pageValid[offset / 8] |= 1 << (offset & 7);
+			CUR_ADDR++;
 		}
 		#endif
 		#ifdef ENABLE_BLANK_CHECK
-		isBlank = 0;
+		isBlank = IMAGE_INCOMPLETE();
 		#endif
 	}
+	#ifdef ENABLE_PATCHING
+	else if (cmd0 == USBTINY_PATCH_PAGE)
+	{
+		for ( i = 0; i < len; i++ ) {
+			patch_op(*data++);
+		}
+		if (isLast) {
+			patch_commit();
+		}
+	}
+	#endif
+	#ifdef ENABLE_BOOT_CONFIG
+	else if (cmd0 == USBTINY_CONFIG_WRITE)
+	{
+		// staged in buffer[], the EEPROM is only written with a complete and valid block,
+		// a block turning USB off would lock out the host sending it, only the app may write that one
+		for ( i = 0; i < len; i++ ) {
+			if (cur_addr.u16[0] < sizeof(bootConfig_t)) {
+				buffer[cur_addr.u16[0]++] = *data++;
+			}
+		}
+		if (isLast && cur_addr.u16[0] == sizeof(bootConfig_t) && boot_config_valid((bootConfig_t *)buffer)
+			&& (((bootConfig_t *)buffer)->flags & BOOT_CONFIG_NO_USB) == 0) {
+			eeprom_update_block(buffer, BOOT_CONFIG_ADDR, sizeof(bootConfig_t));
+		}
+	}
+	#endif
 
 	return isLast;
 }
@@ -395,12 +1154,86 @@ uchar	usbFunctionWrite ( uchar* data, uchar len )
 // ----------------------------------------------------------------------
 int	main ( void )
 {
+	resetCause = MCUSR;
+
+	#ifdef ENABLE_BOOT_CONFIG
+	eeprom_read_block(buffer, BOOT_CONFIG_ADDR, sizeof(bootConfig_t));
+	if (boot_config_valid((bootConfig_t *)buffer)) {
+		config = *(bootConfig_t *)buffer;
+	}
+	#endif
+	#ifdef ENABLE_JOURNAL
+	eeprom_read_block(&journal, BOOT_JOURNAL_ADDR, sizeof(bootJournal_t));
+	if (journal.magic != BOOT_JOURNAL_MAGIC || journal_sum() != 0) {
+		journal.session = JOURNAL_NONE;
+		journal.lastPage = JOURNAL_NONE;
+	}
+	#endif
+
+	if (config.bootPolicy != BOOT_POLICY_ALWAYS) {
+		// clear all flags, so the next reset can be told apart, the app gets them in r2
+		MCUSR = 0;
+	}
+
 	// disable watchdog if previously enabled
 	MCUSR &= ~(1 << WDRF);
 	wdt_disable();
 
+	uint8_t stay = 0;
+	#ifdef ENABLE_MAILBOX
+	// a request left by the app overrides the boot policy, the app resets through the watchdog
+	uint8_t skip = 0;
+	if ((resetCause & _BV(WDRF)) != 0) {
+		skip = (mailbox == BOOT_MAILBOX_APP);
+		stay = (mailbox == BOOT_MAILBOX_ENTER);
+	}
+	#ifdef ENABLE_MAILBOX_EEPROM
+	uint16_t flag = eeprom_read_word(BOOT_MAILBOX_EEPROM);
+	if ((uint8_t)(flag >> 8) == (uint8_t)~flag) {
+		eeprom_write_word(BOOT_MAILBOX_EEPROM, 0xFFFF); // the flag only counts once
+		stay |= (flag == BOOT_FLAG_WORD(BOOT_FLAG_ENTER));
+		skip |= (flag == BOOT_FLAG_WORD(BOOT_FLAG_APP));
+	}
+	#endif
+	#endif
+
+	// start a valid app right away, nothing has been set up yet that needs cleaning up
+	stay |= IMAGE_INCOMPLETE(); // an upload was interrupted
+	if (stay == 0 && pgm_read_word(0) != 0xFFFF)
+	{
+		#ifdef ENABLE_MAILBOX
+		if (skip != 0) {
+			app_start();
+		}
+		#endif
+		if (config.bootPolicy == BOOT_POLICY_EXT_RESET) {
+			if ((resetCause & _BV(EXTRF)) == 0) {
+				app_start();
+			}
+		}
+		else if (config.bootPolicy == BOOT_POLICY_DOUBLE_TAP) {
+			if ((resetCause & _BV(EXTRF)) == 0 || doubleTapMagic != DOUBLE_TAP_MAGIC) {
+				if ((resetCause & _BV(EXTRF)) != 0) {
+					// first tap, another reset within the window finds the magic
+					doubleTapMagic = DOUBLE_TAP_MAGIC;
+					LED_DDR |= _BV(LED);
+					LED_PORT |= _BV(LED);
+					TCCR1B = 0x05;
+					while (TCNT1 < (uint16_t)T1_SLOW_TICKS(DOUBLE_TAP_WINDOW_MS));
+					TCCR1B = 0;
+					TCNT1 = 0;
+					LED_PORT &= ~_BV(LED);
+					LED_DDR &= ~_BV(LED);
+				}
+				doubleTapMagic = 0;
+				app_start();
+			}
+		}
+	}
+	doubleTapMagic = 0;
+
 	#ifdef ENABLE_BLANK_CHECK
-	if (pgm_read_word(0) == 0xFFFF) {
+	if (pgm_read_word(0) == 0xFFFF || IMAGE_INCOMPLETE()) {
 		isBlank = 1;
 	}
 	else {
@@ -416,149 +1249,158 @@ int	main ( void )
 
 	LED_DDR |= _BV(LED); // LED pin on Trinket Pro
 
-	// start USB and force a re-enumeration by faking a disconnect
-	usbInit();
-	usbDeviceDisconnect();
-	LED_PORT |= _BV(LED);
-	while (TCNT1 < 4000);
-	LED_PORT &= ~_BV(LED);
-	usbDeviceConnect();
-	sei();
-
+	if ((config.flags & BOOT_CONFIG_NO_USB) == 0)
+	{
+		// start USB and force a re-enumeration by faking a disconnect
+		uint16_t disconnectTicks = usb_disconnect_ticks();
+		#ifdef ENABLE_BOOT_STATS
+		stats.disconnectTicks = disconnectTicks;
+		#endif
+		#if USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER & USB_PROP_IS_RAM
+		build_serial_number();
+		#endif
+		usbInit();
+		usbDeviceDisconnect();
+		LED_PORT |= _BV(LED);
+		TCNT1 = 0;
+		while (TCNT1 < disconnectTicks);
+		LED_PORT &= ~_BV(LED);
+		usbDeviceConnect();
+	}
 	TCCR1B = 0x01; // speed up timer for PWM LED pulsing
-	uint8_t t1ovf = 0;
-	uint16_t duty = 0;
-	char dutyDir = 0;
+	TCNT1 = 0;
+	TIFR1 = _BV(TOV1) | _BV(OCF1A);
+	TIMSK1 = _BV(TOIE1);
+	#ifdef ENABLE_HOST_DETECT
+	hostWait = HOST_DETECT_OVF;
+	char uartHadRx = 0;
+	#endif
+	sei();
 
 	#ifdef ENABLE_OPTIBOOT
-	optiboot_init();
+	uint8_t uartEnabled = (config.flags & BOOT_CONFIG_NO_UART) == 0;
+	if (uartEnabled) {
+		optiboot_init();
+	}
+	#endif
+	#ifdef ENABLE_IDLE_SLEEP
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	#endif
 
-	// main program loop
+	// main program loop, woken by the USB, UART and Timer1 interrupts
+	// USB is always served first after waking up. Timer1 overflows every 65536 clocks
+	// (4.1 ms at 16 MHz), so without UART traffic usbPoll() runs at least that often,
+	// well within the 50 ms V-USB allows. A UART command however runs to completion
+	// before usbPoll() is called again, at about 87 us per byte at 115200 baud:
+	// - STK500v1 PROG_PAGE/READ_PAGE of one 128 byte page, about 16 ms with its write,
+	//   but the length is 16 bits, a 65535 byte block holds USB off for about 5.7 s
+	// - STK500v2 CMD_PROGRAM_FLASH_ISP of STK500V2_MAX_BLOCK (512) bytes, about 46 ms
+	//   to receive plus four page erase and write cycles of about 9 ms, about 82 ms
+	// - a host stopping in the middle of a command, up to OPTIBOOT_UART_TIMEOUT (1 s)
+	//   until getch() gives up and the bootloader leaves
+	// So USB can not be relied on while a UART upload is running. ENABLE_BOOT_STATS
+	// reports the longest gap seen, in Timer1 overflows and saturating at 255.
 	while (1)
 	{
-		usbPoll();
+		if ((config.flags & BOOT_CONFIG_NO_USB) == 0) {
+			usbPoll();
+			#ifdef ENABLE_BOOT_STATS
+			pollAge = 0;
+			#endif
+		}
 
 		#ifdef ENABLE_OPTIBOOT
-		char ob = optibootPoll();
+		char ob = uartEnabled ? optibootPoll() : 0;
+		#ifdef ENABLE_HOST_DETECT
+		uartHadRx |= ob;
+		#endif
 		if (ob == 1) {
 			timeout = 0;
 		}
-		else if (ob == 2
-		#ifdef ENABLE_BLANK_CHECK
-		&& isBlank == 0
-		#endif
-		) {
+		else if (ob == 2) {
+			// the host asked to leave, a protocol error (3) only drops the command
+			#ifdef ENABLE_JOURNAL
+			journal_close();
+			#endif
+			#ifdef ENABLE_BLANK_CHECK
+			// the UART upload may have just programmed a blank chip
+			isBlank = pgm_read_word(0) == 0xFFFF || IMAGE_INCOMPLETE();
+			if (isBlank == 0)
+			#endif
 			break;
 		}
 		#endif
 
-		if ( ((usbHasRxed != 0) && (timeout > USBBOOTLOADER_TIMEOUT)
+		if ( ((usbHasRxed != 0) && (timeout > config.usbTimeout)
 		#ifdef ENABLE_BLANK_CHECK
 		&& isBlank == 0
 		#endif
-		    ) || ((usbHasRxed == 0) && (timeout > UARTBOOTLOADER_TIMEOUT)
+		    ) || ((usbHasRxed == 0) && (timeout > config.uartTimeout)
 		#ifdef ENABLE_BLANK_CHECK
 		&& isBlank == 0
 		#endif
 			  )
 		#ifdef ENABLE_REQUEST_EXIT
 		|| req_boot_exit != 0
+		#endif
+		#ifdef ENABLE_HOST_DETECT
+		|| (hostWait == 0 && usbHadReset == 0 && usbHasRxed == 0
+		#if USB_COUNT_SOF
+		&& usbSofCount == 0
+		#endif
+		#ifdef ENABLE_OPTIBOOT
+		&& uartHadRx == 0
+		#endif
+		#ifdef ENABLE_BLANK_CHECK
+		&& isBlank == 0
+		#endif
+		   )
 		#endif
 		
 		     )    {
 			// requested exit
 			// or timed out waiting for activity (timeout means not connected to computer)
+			// or nothing is attached at all
 			break;
 		}
 
-		uint16_t t = TCNT1;
-		if ((TIFR1 & _BV(TOV1)) != 0) // if timer has overflowed
-		{
-			TIFR1 |= _BV(TOV1); // clear the flag
-			if (usbHasRxed != 0)
-			{
-				LED_PORT |= _BV(LED);
-				if (duty == 0) {
-					dutyDir = dutyDir ? 0 : 1;
-				}
-
-				#define WAITING_LED_FADE_RATE 512 // must be power of 2
-				if (dutyDir == 0) {
-					duty -= WAITING_LED_FADE_RATE;
-				}
-				else {
-					duty += WAITING_LED_FADE_RATE;
-				}
+		#ifdef ENABLE_IDLE_SLEEP
+		// nothing left to do until the next interrupt, unless a USB packet came in meanwhile
+		cli();
+		if (usbRxLen == 0
+		#ifdef ENABLE_OPTIBOOT
+		&& !boot_spm_busy()
+		#endif
+		   ) {
+			#ifdef ENABLE_OPTIBOOT
+			if (uartEnabled) {
+				optiboot_wake_on_rx();
 			}
-			t1ovf++;
-
-			// roughly 1 second
-			#if (F_CPU == 12000000)
-			if (t1ovf > 183) {
-			#elif (F_CPU == 16000000)
-			if (t1ovf > 244) {
 			#endif
-				t1ovf = 0;
-				timeout++;
-			}
-		}
-
-		if (usbHasRxed != 0)
-		{
-			// fade the LED
-			if (t > duty) {
-				LED_PORT &= ~_BV(LED);
-			}
-		}
-		else
-		{
-			#define WAITING_LED_BLINK_RATE 16
-			if  ((t1ovf > (WAITING_LED_BLINK_RATE * 0)
-			  &&  t1ovf < (WAITING_LED_BLINK_RATE * 1))
-			  || (t1ovf > (WAITING_LED_BLINK_RATE * 2)
-			  &&  t1ovf < (WAITING_LED_BLINK_RATE * 3))
-			  #if (F_CPU == 16000000)
-			  || (t1ovf > (WAITING_LED_BLINK_RATE * 4)
-			  &&  t1ovf < (WAITING_LED_BLINK_RATE * 5))
-			  #endif
-			  ) {
-			  LED_PORT |= _BV(LED);
-			}
-			else {
-			  LED_PORT &= ~_BV(LED);
-			}
+			sleep_enable();
+			sei();
+			sleep_cpu(); // the instruction after sei() always runs, an interrupt pending by now wakes us at once
+			sleep_disable();
 		}
+		sei();
+		#endif
 	}
 
-	// turn off and return port to normal
-	LED_PORT &= ~_BV(LED);
-	LED_DDR  &= ~_BV(LED);
-
 	#if defined(ENABLE_REQUEST_EXIT) && defined(ENABLE_CLEAN_EXIT)
 	// wait to finish all USB comms, avoids "avrdude: error: usbtiny_transmit: usb_control_msg: sending control message failed"
+	// the zero-length status reply to USBTINY_POWERDOWN was queued in the usbPoll() that set req_boot_exit,
+	// usbTxLen goes back to idle (bit 4 set) once the interrupt has sent it. Sent as an IN request, like
+	// avrdude does, the status stage is a zero-length OUT from the host instead, which the interrupt
+	// acknowledges without usbPoll() seeing it, only usbCurrentTok changes. It is cleared when the
+	// request is handled, an OUT token from then on is acknowledged. The timer is only a fallback
+	TIMSK1 = 0;
 	TCCR1B = 0x05; // slow down timer
 	TCNT1 = 0;
-	while (req_boot_exit != 0 && TCNT1 < 4000) usbPoll();
+	while (req_boot_exit != 0 && (usbTxLen & 0x10) == 0 && usbCurrentTok != USBPID_OUT
+		&& TCNT1 < (uint16_t)T1_SLOW_TICKS(CLEAN_EXIT_MS)) usbPoll();
 	#endif
 
-	// cleanup!
-
-	// reset timer
-	TCCR1B = 0;
-	TCNT1 = 0;
-
-	// deinitialize USB
-	USB_INTR_ENABLE = 0;
-	USB_INTR_CFG = 0;
-
-	// move interrupt back
-	MCUCR = (1 << IVCE);	// enable change of interrupt vectors
-	MCUCR = (0 << IVSEL);	// move interrupts to app flash section
-
-	cli();// disable interrupts
-
-	app_start(); // jump to user app
+	leave_bootloader();
 
 	return 0;
 }
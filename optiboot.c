@@ -41,22 +41,349 @@
 #define FROM_OPTIBOOT_C
 #include "optiboot.h"
 #include <util/delay.h>
-#include <avr/wdt.h>
+#include <avr/interrupt.h>
+#ifdef OPTIBOOT_FRAME_MODE
+#include <util/crc16.h>
+#endif
+
+#ifdef OPTIBOOT_STK500V2
+static uint8_t  buff[STK500V2_HEADER + STK500V2_MAX_BLOCK];
+static uint8_t  stk500v2Mode = 0;
+#else
+static uint8_t  buff[SPM_PAGESIZE];
+#endif
+static addr_t   address = 0;
+static uint16_t length;
+#if (FLASHEND) > 0xFFFF
+static uint8_t  extAddress = 0;     // from the last load extended address
+#endif
+
+// Convert a word address from the host to a byte address
+static addr_t byteAddress(uint16_t wordAddress)
+{
+#if (FLASHEND) > 0xFFFF
+  return ((addr_t)extAddress << 17) | ((addr_t)wordAddress << 1);
+#else
+  return wordAddress + wordAddress;
+#endif
+}
+
+#ifdef OPTIBOOT_FRAME_MODE
+static uint8_t  frameMode = 0;
+static uint8_t  frameState = 0;     // 0: idle, 1: erasing before write, 2: writing
+static addr_t   frameAddress;       // page being programmed in the background
+static uint16_t frameCrc;
+
+// Advance the background programming of the last accepted frame, never waits
+static void frameSpmService(void)
+{
+  if (frameState == 0 || boot_spm_busy()) return;
+  if (frameState == 1) {
+    optiboot_page_write(frameAddress);
+    frameState = 2;
+  }
+  else {
+#if defined(RWWSRE)
+    boot_rww_enable();
+#endif
+    frameState = 0;
+  }
+}
+
+static uint8_t getchCrc(void)
+{
+  uint8_t ch = getch();
+  frameCrc = _crc_ccitt_update(frameCrc, ch);
+  frameSpmService();
+  return ch;
+}
+
+static char framePoll(void)
+{
+  uint8_t seq, len;
+  uint16_t count, newAddress;
+  addr_t addrPtr;
+  uint8_t *bufPtr;
+
+  // Anything else than a frame start is skipped to resynchronize
+  if (getch() != FRAME_SOF) return 1;
+
+  frameCrc = 0xFFFF;
+  seq = getchCrc();
+  newAddress = getchCrc();
+  newAddress |= getchCrc() << 8;
+  len = getchCrc();
+  if (len > SPM_PAGESIZE || (newAddress & (SPM_PAGESIZE / 2 - 1)) != 0) {
+    putch(FRAME_NAK);
+    putch(seq);
+    return 1;
+  }
+
+  bufPtr = buff;
+  count = len;
+  while (count--) *bufPtr++ = getchCrc();
+  getchCrc();
+  getchCrc();
+  // Running the CRC over its own (little endian) value leaves zero
+  if (frameCrc != 0) {
+    putch(FRAME_NAK);
+    putch(seq);
+    return 1;
+  }
+
+  // The previous page has to be done before the programming buffer is reused
+  while (frameState) frameSpmService();
 
-static uint8_t  buff[SPM_PAGESIZE * 2];
-static uint16_t address = 0;
-static uint8_t  length;
+  if (len == 0) {
+    // End of session, leave like STK_LEAVE_PROGMODE does
+    frameMode = 0;
+    putch(FRAME_ACK);
+    putch(seq);
+    flushTx();
+    return 2;
+  }
+
+  // Pad a partial page with erased flash
+  count = len;
+  while (count < SPM_PAGESIZE) buff[count++] = 0xFF;
+
+  // Fill the programming buffer before the erase, so erase and write both
+  // run in the background while the next frame comes in
+  boot_spm_busy_wait();
+  bufPtr = buff;
+  count = SPM_PAGESIZE / 2;
+  frameAddress = addrPtr = byteAddress(newAddress);
+  do {
+    uint16_t a;
+    a = *bufPtr++;
+    a |= (*bufPtr++) << 8;
+    optiboot_page_fill(addrPtr, a);
+    addrPtr += 2;
+  } while (--count);
+  optiboot_page_erase(frameAddress);
+  frameState = 1;
+
+  putch(FRAME_ACK);
+  putch(seq);
+  return 1;
+}
+#endif
+
+#ifdef OPTIBOOT_STK500V2
+// Program whole pages from data, padding a partial last page with erased flash
+static void stk500v2WriteFlash(uint8_t *data, uint16_t count)
+{
+  uint16_t i;
+  for (i = count; i & (SPM_PAGESIZE - 1); i++) data[i] = 0xFF;
+
+  while (count) {
+    addr_t addrPtr = address;
+    uint8_t words = SPM_PAGESIZE / 2;
+
+    optiboot_page_erase(address);
+    boot_spm_busy_wait();
+    do {
+      uint16_t a;
+      a = *data++;
+      a |= (*data++) << 8;
+      optiboot_page_fill(addrPtr, a);
+      addrPtr += 2;
+    } while (--words);
+    optiboot_page_write(address);
+    boot_spm_busy_wait();
+
+    address += SPM_PAGESIZE;
+    count = (count > SPM_PAGESIZE) ? count - SPM_PAGESIZE : 0;
+  }
+#if defined(RWWSRE)
+  // Reenable read access to flash
+  boot_rww_enable();
+#endif
+}
+
+// Receive and answer one STK500v2 message, MESSAGE_START has already been read
+static char stk500v2Message(void)
+{
+  uint8_t seq, ch, checksum;
+  uint16_t size, count;
+  uint8_t *bufPtr;
+  char ret = 1;
+
+  checksum = MESSAGE_START;
+  seq = getch();
+  checksum ^= seq;
+  ch = getch();
+  checksum ^= ch;
+  size = ch << 8;
+  ch = getch();
+  checksum ^= ch;
+  size |= ch;
+  ch = getch();
+  checksum ^= ch;
+  if (ch != TOKEN || size == 0 || size > sizeof(buff)) return 0;
+
+  bufPtr = buff;
+  count = size;
+  do {
+    ch = getch();
+    checksum ^= ch;
+    *bufPtr++ = ch;
+  } while (--count);
+  checksum ^= getch();
+
+  stk500v2Mode = 1;
+  ch = buff[0];
+  count = (buff[1] << 8) | buff[2]; // NumBytes of the block commands
+  size = 2;
+  if (checksum != 0) {
+    buff[0] = ANSWER_CKSUM_ERROR;
+    buff[1] = STATUS_CKSUM_ERROR;
+  }
+  else if (ch == CMD_SIGN_ON) {
+    const char *signOn = "AVRISP_2";
+    buff[1] = STATUS_CMD_OK;
+    buff[2] = 8;
+    bufPtr = buff + 3;
+    while (*signOn) *bufPtr++ = *signOn++;
+    size = 11;
+  }
+  else if (ch == CMD_GET_PARAMETER) {
+    // like STK_GET_PARAMETER, a generic 0x03 keeps Avrdude happy
+    uint8_t which = buff[1];
+    buff[1] = STATUS_CMD_OK;
+    buff[2] = (which == PARAM_SW_MAJOR) ? OPTIBOOT_MAJVER :
+              (which == PARAM_SW_MINOR) ? OPTIBOOT_MINVER : 0x03;
+    size = 3;
+  }
+  else if (ch == CMD_LOAD_ADDRESS) {
+    // 32 bit word address, bit 31 only tells the load extended address was done
+#if (FLASHEND) > 0xFFFF
+    extAddress = buff[2];
+#endif
+    address = byteAddress((buff[3] << 8) | buff[4]);
+    buff[1] = STATUS_CMD_OK;
+  }
+  else if (ch == CMD_PROGRAM_FLASH_ISP || ch == CMD_PROGRAM_EEPROM_ISP) {
+    buff[1] = STATUS_CMD_FAILED;
+    if (count <= STK500V2_MAX_BLOCK && count + STK500V2_HEADER <= size) {
+      bufPtr = buff + STK500V2_HEADER;
+      if (ch == CMD_PROGRAM_FLASH_ISP) {
+        stk500v2WriteFlash(bufPtr, count);
+      }
+      else {
+        // EEPROM addresses are byte addresses, undo the word to byte conversion of CMD_LOAD_ADDRESS
+        uint16_t eeAddr = (uint16_t)(address >> 1);
+        address += count + count;
+        while (count--) eeprom_write_byte((uint8_t *)eeAddr++, *bufPtr++);
+      }
+      buff[1] = STATUS_CMD_OK;
+    }
+  }
+  else if (ch == CMD_READ_FLASH_ISP || ch == CMD_READ_EEPROM_ISP) {
+    if (count > STK500V2_MAX_BLOCK) {
+      buff[1] = STATUS_CMD_FAILED;
+    }
+    else {
+      buff[1] = STATUS_CMD_OK;
+      bufPtr = buff + 2;
+      size = count + 3;
+      if (ch == CMD_READ_EEPROM_ISP) {
+        uint16_t eeAddr = (uint16_t)(address >> 1);
+        address += count + count;
+        while (count--) *bufPtr++ = eeprom_read_byte((uint8_t *)eeAddr++);
+      }
+      else while (count--) {
+#if (FLASHEND) > 0xFFFF
+        ch = pgm_read_byte_far(address++);
+#else
+        optiboot_read_flash_inc(ch, address);
+#endif
+        *bufPtr++ = ch;
+      }
+      *bufPtr = STATUS_CMD_OK;
+    }
+  }
+  else if (ch == CMD_READ_FUSE_ISP || ch == CMD_READ_LOCK_ISP ||
+           ch == CMD_READ_SIGNATURE_ISP || ch == CMD_READ_OSCCAL_ISP) {
+    // the ISP instruction bytes tell which fuse or signature byte is wanted
+    uint8_t cmd1 = buff[2], cmd2 = buff[3], cmd3 = buff[4];
+    buff[1] = STATUS_CMD_OK;
+    if (ch == CMD_READ_SIGNATURE_ISP) {
+      buff[2] = (cmd3 == 0) ? SIGNATURE_0 : (cmd3 == 1) ? SIGNATURE_1 : SIGNATURE_2;
+    }
+    else if (ch == CMD_READ_LOCK_ISP) {
+      buff[2] = boot_lock_fuse_bits_get(GET_LOCK_BITS);
+    }
+    else if (ch == CMD_READ_OSCCAL_ISP) {
+      buff[2] = OSCCAL;
+    }
+    else if (cmd1 == 0x58) {
+      buff[2] = boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+    }
+    else if (cmd2 == 0x08) {
+      buff[2] = boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
+    }
+    else {
+      buff[2] = boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+    }
+    buff[3] = STATUS_CMD_OK;
+    size = 4;
+  }
+  else if (ch == CMD_LEAVE_PROGMODE_ISP) {
+    // Adaboot no-wait mod, same as STK_LEAVE_PROGMODE
+    buff[1] = STATUS_CMD_OK;
+    ret = 2;
+  }
+  else if (ch == CMD_SET_PARAMETER || ch == CMD_ENTER_PROGMODE_ISP || ch == CMD_CHIP_ERASE_ISP) {
+    // ignored, like their STK500v1 counterparts
+    buff[1] = STATUS_CMD_OK;
+  }
+  else {
+    buff[1] = STATUS_CMD_UNKNOWN;
+  }
+
+  // Send the answer, the checksum is the XOR of all bytes
+  putch(MESSAGE_START);
+  putch(seq);
+  putch(size >> 8);
+  putch(size & 0xFF);
+  putch(TOKEN);
+  checksum = MESSAGE_START ^ seq ^ (size >> 8) ^ (size & 0xFF) ^ TOKEN;
+  bufPtr = buff;
+  do {
+    ch = *bufPtr++;
+    checksum ^= ch;
+    putch(ch);
+  } while (--size);
+  putch(checksum);
+  if (ret == 2) flushTx();
+  return ret;
+}
+#endif
 
 char optibootPoll()
 {
   unsigned char ch;
+#ifdef OPTIBOOT_FRAME_MODE
+  if (frameMode) {
+    frameSpmService();
+    if (UART_SRA & _BV(RXC0)) return framePoll();
+    return 0;
+  }
+#endif
   if (UART_SRA & _BV(RXC0))
   {
     ch = getch();
 
+#ifdef OPTIBOOT_STK500V2
+    if (ch == MESSAGE_START) return stk500v2Message();
+    // Once the host talks STK500v2, bytes outside a message are noise
+    if (stk500v2Mode) return 0;
+#endif
+
     if(ch == STK_GET_PARAMETER) {
       unsigned char which = getch();
-      if (verifySpace()) return 2;
+      if (verifySpace()) return 3;
       if (which == 0x82) {
         /*
          * Send optiboot version as "minor SW version"
@@ -74,75 +401,108 @@ char optibootPoll()
     }
     else if(ch == STK_SET_DEVICE) {
       // SET DEVICE is ignored
-      if (getNch(20)) return 2;
+      if (getNch(20)) return 3;
     }
     else if(ch == STK_SET_DEVICE_EXT) {
       // SET DEVICE EXT is ignored
-      if (getNch(5)) return 2;
+      if (getNch(5)) return 3;
     }
     else if(ch == STK_LOAD_ADDRESS) {
       // LOAD ADDRESS
       uint16_t newAddress;
       newAddress = getch();
       newAddress = (newAddress & 0xff) | (getch() << 8);
-#ifdef RAMPZ
-      // Transfer top bit to RAMPZ
-      RAMPZ = (newAddress & 0x8000) ? 1 : 0;
-#endif
-      newAddress += newAddress; // Convert from word address to byte address
-      address = newAddress;
-      if (verifySpace()) return 2;
+      address = byteAddress(newAddress); // Convert from word address to byte address
+      if (verifySpace()) return 3;
     }
     else if(ch == STK_UNIVERSAL) {
+#if (FLASHEND) > 0xFFFF
+      // LOAD EXTENDED ADDRESS is needed for addressing more than 128 KB,
+      // all other UNIVERSAL commands are ignored
+      if (getch() == AVR_OP_LOAD_EXT_ADDR) {
+        getch();
+        extAddress = getch();
+        if (getNch(1)) return 3;
+      }
+      else if (getNch(3)) return 3;
+#else
       // UNIVERSAL command is ignored
-      if (getNch(4)) return 2;
+      if (getNch(4)) return 3;
+#endif
       putch(0x00);
     }
     /* Write memory, length is big endian and is in bytes */
     else if(ch == STK_PROG_PAGE) {
       // PROGRAM PAGE - we support flash programming only, not EEPROM
+      // Blocks longer than a page program consecutive pages
       uint8_t *bufPtr;
-      uint16_t addrPtr;
+      addr_t addrPtr;
 
-      getch();                  /* getlen() */
-      length = getch();
+      length = getch() << 8;    /* getlen() */
+      length |= getch();
       getch();
 
-      // If we are in RWW section, immediately start page erase
-      if (address < NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
+      // A zero length would program a stale page, refuse it
+      if (length == 0) {
+        if (verifySpace()) return 3;
+        putch(STK_FAILED);
+        return 1;
+      }
 
-      // While that is going on, read in page contents
-      bufPtr = buff;
-      do *bufPtr++ = getch();
-      while (--length);
+      do {
+        uint16_t count = length;
+        uint8_t erased = 0;
+        if (count > SPM_PAGESIZE) count = SPM_PAGESIZE;
+        length -= count;
 
-      // If we are in NRWW section, page erase has to be delayed until now.
-      // Todo: Take RAMPZ into account (not doing so just means that we will
-      //  treat the top of both "pages" of flash as NRWW, for a slight speed
-      //  decrease, so fixing this is not urgent.)
-      if (address >= NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
+        // While reading in page contents, start the page erase as soon as the
+        // write of the previous page is done, if we are in the RWW section
+        bufPtr = buff;
+        while (count--) {
+          if (!erased && address < NRWWSTART && !boot_spm_busy()) {
+            optiboot_page_erase(address);
+            erased = 1;
+          }
+          *bufPtr++ = getch();
+        }
+        // The last page may be partial, pad it like stk500v2WriteFlash()
+        while (bufPtr < buff + SPM_PAGESIZE) *bufPtr++ = 0xFF;
 
-      // Read command terminator, start reply
-      if (verifySpace()) return 2;
+        // Read command terminator after the last page, start reply
+        if (length == 0 && verifySpace()) {
+          // Out of sync, leave the erased page alone but make flash readable again
+          boot_spm_busy_wait();
+#if defined(RWWSRE)
+          boot_rww_enable();
+#endif
+          return 3;
+        }
 
-      // If only a partial page is to be programmed, the erase might not be complete.
-      // So check that here
-      boot_spm_busy_wait();
+        // If we are in NRWW section, page erase has to be delayed until now.
+        // If only a partial page is to be programmed, the erase might not be complete.
+        // So check that here
+        boot_spm_busy_wait();
+        if (!erased) {
+          optiboot_page_erase(address);
+          boot_spm_busy_wait();
+        }
 
-      // Copy buffer into programming buffer
-      bufPtr = buff;
-      addrPtr = (uint16_t)(void*)address;
-      ch = SPM_PAGESIZE / 2;
-      do {
-        uint16_t a;
-        a = *bufPtr++;
-        a |= (*bufPtr++) << 8;
-        __boot_page_fill_short((uint16_t)(void*)addrPtr,a);
-        addrPtr += 2;
-      } while (--ch);
-
-      // Write from programming buffer
-      __boot_page_write_short((uint16_t)(void*)address);
+        // Copy buffer into programming buffer
+        bufPtr = buff;
+        addrPtr = address;
+        ch = SPM_PAGESIZE / 2;
+        do {
+          uint16_t a;
+          a = *bufPtr++;
+          a |= (*bufPtr++) << 8;
+          optiboot_page_fill(addrPtr, a);
+          addrPtr += 2;
+        } while (--ch);
+
+        // Write from programming buffer, the next page is received while this is going on
+        optiboot_page_write(address);
+        address += SPM_PAGESIZE;
+      } while (length);
       boot_spm_busy_wait();
 
 #if defined(RWWSRE)
@@ -153,23 +513,33 @@ char optibootPoll()
     }
     /* Read memory block mode, length is big endian.  */
     else if(ch == STK_READ_PAGE) {
-      // READ PAGE - we only read flash
-      getch();                  /* getlen() */
-      length = getch();
-      getch();
+      // READ PAGE - flash, or EEPROM if memtype is 'E'
+      uint8_t desttype;
+      length = getch() << 8;    /* getlen() */
+      length |= getch();
+      desttype = getch();
 
-      if (verifySpace()) return 2;
-      do {
-#if defined(RAMPZ)
-        // Since RAMPZ should already be set, we need to use EPLM directly.
-        // Also, we can use the autoincrement version of lpm to update "address"
-        //      do putch(pgm_read_byte_near(address++));
-        //      while (--length);
-        // read a Flash and increment the address (may increment RAMPZ)
-        __asm__ ("elpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address));
+      if (verifySpace()) return 3;
+      // A zero length would stream 64 KB
+      if (length == 0) {
+        putch(STK_FAILED);
+        return 1;
+      }
+      if (desttype == 'E') {
+        // Like upstream optiboot, the EEPROM address is the doubled STK_LOAD_ADDRESS
+        uint16_t eeAddr = (uint16_t)address;
+        do {
+          ch = eeprom_read_byte((uint8_t *)eeAddr++);
+          putch(ch);
+        } while (--length);
+      }
+      else do {
+#if (FLASHEND) > 0xFFFF
+        // read a Flash byte beyond 64 KB, pgm_read_byte_far() loads RAMPZ from the address
+        ch = pgm_read_byte_far(address++);
 #else
         // read a Flash byte and increment the address
-        __asm__ ("lpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address));
+        optiboot_read_flash_inc(ch, address);
 #endif
         putch(ch);
       } while (--length);
@@ -178,22 +548,29 @@ char optibootPoll()
     /* Get device signature bytes  */
     else if(ch == STK_READ_SIGN) {
       // READ SIGN - return what Avrdude wants to hear
-      if (verifySpace()) return 2;
+      if (verifySpace()) return 3;
       putch(SIGNATURE_0);
       putch(SIGNATURE_1);
       putch(SIGNATURE_2);
     }
+#ifdef OPTIBOOT_FRAME_MODE
+    else if (ch == STK_FRAME_MODE) {
+      // Switch to windowed frame mode, the window size tells the host we support it
+      if (verifySpace()) return 3;
+      putch(FRAME_WINDOW);
+      frameMode = 1;
+    }
+#endif
     else if (ch == STK_LEAVE_PROGMODE) { /* 'Q' */
-      // Adaboot no-wait mod
-      wdt_enable(WDTO_30MS);
-      if (verifySpace()) return 2;
+      // Adaboot no-wait mod, main() starts the app as soon as the reply is out
+      if (verifySpace()) return 3;
       putch(STK_OK);
-      //app_start(); // jump to user app
-      return 2;  // never reached!
+      flushTx();
+      return 2;
     }
     else {
       // This covers the response to commands like STK_ENTER_PROGMODE
-      if (verifySpace()) return 2;
+      if (verifySpace()) return 3;
     }
     putch(STK_OK);
     return 1;
@@ -203,9 +580,15 @@ char optibootPoll()
 
 void putch(char ch) {
   while (!(UART_SRA & _BV(UDRE0)));
+  UART_SRA = _BV(U2X0) | _BV(TXC0); // clear TXC0, see flushTx()
   UART_UDR = ch;
 }
 
+// Wait until the last byte has left the transmitter, so the UART can be shut down
+static void flushTx(void) {
+  while (!(UART_SRA & _BV(TXC0)));
+}
+
 uint8_t getch(void) {
   uint8_t ch;
 
@@ -221,7 +604,7 @@ uint8_t getch(void) {
   while(!(UART_SRA & _BV(RXC0))) {
     timeout-=10;
     if (timeout <= 0) {
-      app_start(); // jump to user app
+      leave_bootloader(); // jump to user app
     }
     _delay_us(10);
   }
@@ -271,3 +654,58 @@ void optiboot_init(void)
     DDRD |= _BV(PD0);
   #endif
 }
+
+/*
+ * Lets the next received byte wake the main loop from sleep. The interrupt
+ * only switches itself off again, optibootPoll() still reads the byte. It
+ * is naked and leaves SREG alone so it delays the USB interrupt by a few
+ * cycles at most.
+ */
+void optiboot_wake_on_rx(void)
+{
+  #if !defined(__AVR_ATmega8__) && !defined (__AVR_ATmega32__)
+    UART_SRB = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+  #endif
+}
+
+#if !defined(__AVR_ATmega8__) && !defined (__AVR_ATmega32__)
+ISR(UART_RX_vect, ISR_NAKED)
+{
+  asm volatile (
+    "push r24\n\t"
+    "ldi r24, %0\n\t"
+    "sts %1, r24\n\t"
+    "pop r24\n\t"
+    "reti\n\t"
+    :: "M" (_BV(RXEN0) | _BV(TXEN0)), "n" (_SFR_MEM_ADDR(UART_SRB))
+  );
+}
+#endif
+
+/*
+ * Completes a frame mode page still being programmed in the background, its
+ * frame was already acknowledged. Called before leaving the bootloader, which
+ * getch() also does when the host goes away in the middle of a frame.
+ */
+void optiboot_finish(void)
+{
+#ifdef OPTIBOOT_FRAME_MODE
+  while (frameState) frameSpmService();
+  frameMode = 0;
+#endif
+}
+
+void optiboot_deinit(void)
+{
+  // return the UART to its reset state
+  #if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
+    UCSRB = 0;
+    UCSRA = 0;
+    UBRRL = 0;
+  #else
+    UART_SRB = 0;
+    UART_SRA = 0;
+    UART_SRL = 0;
+    DDRD &= ~_BV(PD0);
+  #endif
+}
@@ -43,8 +43,12 @@
 
 #define OPTIBOOT_UART_TIMEOUT 1000000       // in microseconds
 
-char optibootPoll(void);
+char optibootPoll(void); // 0 idle, 1 command answered, 2 host asked to leave, 3 protocol error
 void optiboot_init(void);
+void optiboot_finish(void);
+void optiboot_deinit(void);
+void optiboot_wake_on_rx(void);
+void leave_bootloader(void); // in main.c, restores the peripherals and starts the app
 
 #ifdef FROM_OPTIBOOT_C
 
@@ -54,12 +58,14 @@ void optiboot_init(void);
 #include <avr/pgmspace.h>
 #include "avr_boot.h"
 #include "stk500.h"
+#include "stk500v2.h"
 #include "pin_defs.h"
 
 void putch(char);
 uint8_t getch(void);
 static inline char getNch(uint8_t); /* "static inline" is a compiler hint to reduce code size */
 char verifySpace(void);
+static void flushTx(void);
 uint8_t getLen(void);
 
 #define OPTIBOOT_MAJVER 5
@@ -67,6 +73,38 @@ uint8_t getLen(void);
 
 #define LED_DATA_FLASH
 
+/* Windowed frame mode, an alternative to the stop-and-wait STK500v1 exchange.
+ * The host sends STK_FRAME_MODE CRC_EOP, a bootloader supporting it answers
+ * STK_INSYNC FRAME_WINDOW STK_OK (a plain optiboot answers STK_INSYNC STK_OK).
+ * From then on the host sends page frames:
+ *   FRAME_SOF seq addrL addrH len data[len] crcL crcH
+ * addr is a page aligned word address like for STK_LOAD_ADDRESS, extended by the
+ * last load extended address on large parts, len is at most SPM_PAGESIZE and the CRC
+ * is _crc_ccitt_update() from avr-libc over seq..data, starting at 0xFFFF.
+ * Every frame is answered with FRAME_ACK seq once it is accepted for programming,
+ * or FRAME_NAK seq if it is corrupt. The host may have up to FRAME_WINDOW frames
+ * outstanding and only resends the ones that were NAKed or never acknowledged.
+ * A frame with len 0 ends the session and starts the application.
+ * Not built by default, add -DOPTIBOOT_FRAME_MODE to DEFINES in the Makefile.
+ */
+//#define OPTIBOOT_FRAME_MODE
+#define STK_FRAME_MODE 0x46 // 'F'
+#define FRAME_WINDOW   8
+#define FRAME_SOF      0x7E
+#define FRAME_ACK      0x06
+#define FRAME_NAK      0x15
+
+/* STK500v2 messages (avrdude -c stk500v2 / wiring) are recognized by their
+ * MESSAGE_START byte and answered next to the STK500v1 commands. A message
+ * is checked against its checksum before anything is programmed, so the whole
+ * body is buffered. CMD_PROGRAM_FLASH_ISP and the read commands accept blocks
+ * of up to STK500V2_MAX_BLOCK bytes, programming consecutive pages.
+ * Not built by default, add -DOPTIBOOT_STK500V2 to DEFINES in the Makefile.
+ */
+//#define OPTIBOOT_STK500V2
+#define STK500V2_MAX_BLOCK (SPM_PAGESIZE * 4)
+#define STK500V2_HEADER    10  // CMD_PROGRAM_FLASH_ISP parameters before the data
+
 #ifndef BAUD_RATE
 #if F_CPU >= 8000000L
 #define BAUD_RATE   115200L // Highest rate Avrdude win32 will support
@@ -111,24 +149,56 @@ uint8_t getLen(void);
 #define SIGNATURE_2 0x0A
 #elif defined (__AVR_ATmega1284P__)
 #define RAMSTART (0x100)
-#define NRWWSTART (0xE000)
+#define NRWWSTART (0x1E000)
 #elif defined(__AVR_ATtiny84__)
 #define RAMSTART (0x100)
 #define NRWWSTART (0x0000)
 #elif defined(__AVR_ATmega1280__)
 #define RAMSTART (0x200)
-#define NRWWSTART (0xE000)
+#define NRWWSTART (0x1E000)
+#elif defined(__AVR_ATmega2560__)
+#define RAMSTART (0x200)
+#define NRWWSTART (0x3E000)
 #elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega88__)
 #define RAMSTART (0x100)
 #define NRWWSTART (0x1800)
 #endif
 
+/* Flash addresses are 32 bit on parts with more than 64 KB of flash. The
+ * extended SPM and ELPM variants load RAMPZ from the address every time. */
+#if (FLASHEND) > 0xFFFF
+#define addr_t                  uint32_t
+#define optiboot_page_fill(a,d) __boot_page_fill_extended_short(a, d)
+#define optiboot_page_erase(a)  __boot_page_erase_extended_short(a)
+#define optiboot_page_write(a)  __boot_page_write_extended_short(a)
+#else
+#define addr_t                  uint16_t
+#define optiboot_page_fill(a,d) __boot_page_fill_short(a, d)
+#define optiboot_page_erase(a)  __boot_page_erase_short(a)
+#define optiboot_page_write(a)  __boot_page_write_short(a)
+#endif
+
+/* Reads the Flash byte at address into ch and moves address on, one lpm Z+.
+ * The host build of the firmware (host/fw/) replaces it. */
+#ifndef optiboot_read_flash_inc
+#define optiboot_read_flash_inc(ch, address) \
+  __asm__ ("lpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address))
+#endif
+
+/* STK_UNIVERSAL "load extended address" instruction, selects the 128 KB segment */
+#define AVR_OP_LOAD_EXT_ADDR 0x4D
+
 #if UART == 0
 # define UART_SRA UCSR0A
 # define UART_SRB UCSR0B
 # define UART_SRC UCSR0C
 # define UART_SRL UBRR0L
 # define UART_UDR UDR0
+# if defined(USART_RX_vect)
+#  define UART_RX_vect USART_RX_vect
+# else
+#  define UART_RX_vect USART0_RX_vect
+# endif
 #elif UART == 1
 #if !defined(UDR1)
 #error UART == 1, but no UART1 on device
@@ -138,6 +208,7 @@ uint8_t getLen(void);
 # define UART_SRC UCSR1C
 # define UART_SRL UBRR1L
 # define UART_UDR UDR1
+# define UART_RX_vect USART1_RX_vect
 #elif UART == 2
 #if !defined(UDR2)
 #error UART == 2, but no UART2 on device
@@ -147,6 +218,7 @@ uint8_t getLen(void);
 # define UART_SRC UCSR2C
 # define UART_SRL UBRR2L
 # define UART_UDR UDR2
+# define UART_RX_vect USART2_RX_vect
 #elif UART == 3
 #if !defined(UDR1)
 #error UART == 3, but no UART3 on device
@@ -156,6 +228,7 @@ uint8_t getLen(void);
 # define UART_SRC UCSR3C
 # define UART_SRL UBRR3L
 # define UART_UDR UDR3
+# define UART_RX_vect USART3_RX_vect
 #endif
 
 #endif
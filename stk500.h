@@ -3,7 +3,7 @@
 
 /* STK500 constants list, from AVRDUDE */
 #define STK_OK              0x10
-#define STK_FAILED          0x11  // Not used
+#define STK_FAILED          0x11
 #define STK_UNKNOWN         0x12  // Not used
 #define STK_NODEVICE        0x13  // Not used
 #define STK_INSYNC          0x14  // ' '
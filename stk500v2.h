@@ -0,0 +1,43 @@
+#ifndef STK500V2_H_
+#define STK500V2_H_
+
+/* STK500v2 constants list, from AVRDUDE and Atmel AN AVR068 */
+#define MESSAGE_START                   0x1B
+#define TOKEN                           0x0E
+
+// general commands
+#define CMD_SIGN_ON                     0x01
+#define CMD_SET_PARAMETER               0x02
+#define CMD_GET_PARAMETER               0x03
+#define CMD_OSCCAL                      0x05  // Not used
+#define CMD_LOAD_ADDRESS                0x06
+
+// ISP commands
+#define CMD_ENTER_PROGMODE_ISP          0x10
+#define CMD_LEAVE_PROGMODE_ISP          0x11
+#define CMD_CHIP_ERASE_ISP              0x12
+#define CMD_PROGRAM_FLASH_ISP           0x13
+#define CMD_READ_FLASH_ISP              0x14
+#define CMD_PROGRAM_EEPROM_ISP          0x15
+#define CMD_READ_EEPROM_ISP             0x16
+#define CMD_PROGRAM_FUSE_ISP            0x17  // Not used
+#define CMD_READ_FUSE_ISP               0x18
+#define CMD_PROGRAM_LOCK_ISP            0x19  // Not used
+#define CMD_READ_LOCK_ISP               0x1A
+#define CMD_READ_SIGNATURE_ISP          0x1B
+#define CMD_READ_OSCCAL_ISP             0x1C
+#define CMD_SPI_MULTI                   0x1D  // Not used
+
+// status codes
+#define STATUS_CMD_OK                   0x00
+#define STATUS_CMD_FAILED               0xC0
+#define STATUS_CKSUM_ERROR              0xC1
+#define STATUS_CMD_UNKNOWN              0xC9
+#define ANSWER_CKSUM_ERROR              0xB0
+
+// parameters
+#define PARAM_HW_VER                    0x90
+#define PARAM_SW_MAJOR                  0x91
+#define PARAM_SW_MINOR                  0x92
+
+#endif
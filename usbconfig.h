@@ -108,7 +108,11 @@
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
  */
+#if defined(BOOTLOADER_ADDRESS) && (BOOTLOADER_ADDRESS) > 0xFFFF
+#define USB_CFG_DRIVER_FLASH_PAGE       ((BOOTLOADER_ADDRESS) >> 16)
+#else
 #define USB_CFG_DRIVER_FLASH_PAGE       0
+#endif
 /* If the device has more than 64 kBytes of flash, define this to the 64 k page
  * where the driver's constants (descriptors) are located. Or in other words:
  * Define this to 1 for boot loaders on the ATMega128.
@@ -128,7 +132,10 @@ extern volatile char usbHasRxed;
  * proceed, do a return after doing your things. One possible application
  * (besides debugging) is to flash a status LED on each packet.
  */
-/* #define USB_RESET_HOOK(resetStarts)     if(!resetStarts){hadUsbReset();} */
+#ifndef __ASSEMBLER__
+extern volatile char usbHadReset;
+#endif
+#define USB_RESET_HOOK(resetStarts)     if(resetStarts){usbHadReset = 1;}
 /* This macro is a hook if you need to know when an USB RESET occurs. It has
  * one parameter which distinguishes between the start of RESET state and its
  * end.
@@ -137,10 +144,15 @@ extern volatile char usbHasRxed;
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
+#ifndef USB_COUNT_SOF
 #define USB_COUNT_SOF                   0
+#endif
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
+ * The bootloader then keeps its timeouts with the 1 ms SOFs while a host is
+ * attached. The Trinket Pro has INT0 on D+, so it is off for this board,
+ * other boards can use DEFINES=-DUSB_COUNT_SOF=1 with their interrupt on D-.
  */
 /* #ifdef __ASSEMBLER__
  * macro myAssemblerMacro
@@ -217,6 +229,14 @@ extern volatile char usbHasRxed;
  */
 /*#define USB_CFG_SERIAL_NUMBER   'N', 'o', 'n', 'e' */
 /*#define USB_CFG_SERIAL_NUMBER_LEN   0 */
+#define USB_CFG_SERIAL_NUMBER_DIGITS    20
+#define USB_CFG_SERIAL_NUMBER_SIG_ADDR  0x0E
+/* The bootloader builds its serial number in RAM at startup, as hex digits of
+ * the lot, wafer and die position bytes in the signature row starting at
+ * USB_CFG_SERIAL_NUMBER_SIG_ADDR, which tell boards apart on a shared hub.
+ * See build_serial_number() in main.c. To leave it out, set
+ * USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER below to 0.
+ */
 /* Same as above for the serial number. If you don't want a serial number,
  * undefine the macros.
  * It may be useful to provide the serial number through other means than at
@@ -308,7 +328,7 @@ extern volatile char usbHasRxed;
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
-#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    (USB_PROP_IS_RAM | USB_PROP_LENGTH(2 * USB_CFG_SERIAL_NUMBER_DIGITS + 2))
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0